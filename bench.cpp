@@ -0,0 +1,918 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <malloc.h>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <micrograd/approx.hpp>
+#include <micrograd/engine.hpp>
+#include <micrograd/expr.hpp>
+#include <micrograd/grad.hpp>
+#include <micrograd/incremental.hpp>
+#include <micrograd/nn.hpp>
+#include <micrograd/pipeline.hpp>
+
+struct Result
+{
+    std::string name;
+    double value;
+    std::string unit;
+    bool higher_is_better;
+};
+
+using Clock = std::chrono::steady_clock;
+
+// Runs fn `reps` times and returns the fastest run in nanoseconds. The minimum
+// is the least noisy estimate on a shared machine.
+double time_ns(size_t reps, const std::function<void()> &fn)
+{
+    double best = 0;
+    for (size_t r = 0; r < reps; r++)
+    {
+        auto start = Clock::now();
+        fn();
+        double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        if (r == 0 || ns < best)
+        {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+// Builds a chain of `n` applications of op, so that both the forward (building
+// the chain) and the backward (walking it) cost can be divided per node. The
+// chain is retained so that every rep walks all of it.
+void bench_op(std::vector<Result> &results, const std::string &name, Value::value_type start,
+              const std::function<Value(Value &)> &op)
+{
+    const size_t n = 20000;
+    const size_t reps = 3;
+    Value x(start);
+
+    double forward = time_ns(reps, [&]()
+                             {
+        x = Value(start);
+        for (size_t i = 0; i < n; i++)
+        {
+            x = op(x);
+        } });
+
+    double backward = time_ns(reps, [&]()
+                              { x.backward(1, true); });
+
+    results.push_back({"forward/" + name, forward / n, "ns/op", false});
+    results.push_back({"backward/" + name, backward / n, "ns/op", false});
+}
+
+void bench_ops(std::vector<Result> &results)
+{
+    Value b(1.0f, "b");
+    Value e(2.0f, "e");
+    Value k(1e-3f, "k");
+    float c = 1e-3f;
+    float one = 1.0f;
+
+    bench_op(results, "add", 0.0f, [&](Value &x)
+             { return x + k; });
+    bench_op(results, "sub", 0.0f, [&](Value &x)
+             { return x - k; });
+    bench_op(results, "mul", 1.0f, [&](Value &x)
+             { return x * b; });
+    bench_op(results, "div", 1.0f, [&](Value &x)
+             { return x / b; });
+    bench_op(results, "pow", 1.0f, [&](Value &x)
+             { return x.pow(e); });
+    bench_op(results, "tanh", 0.5f, [&](Value &x)
+             { return x.tanh(); });
+    bench_op(results, "exp", -1.0f, [&](Value &x)
+             { return x.exp(); });
+    bench_op(results, "neg", 1.0f, [&](Value &x)
+             { return -x; });
+    bench_op(results, "square", 1.0f, [&](Value &x)
+             { return x.square(); });
+    bench_op(results, "reciprocal", 2.0f, [&](Value &x)
+             { return x.reciprocal(); });
+    bench_op(results, "add_scalar", 0.0f, [&](Value &x)
+             { return x + c; });
+    bench_op(results, "mul_scalar", 1.0f, [&](Value &x)
+             { return x * one; });
+
+    // Temporaries as operands
+    bench_op(results, "mul_add", 1.0f, [&](Value &x)
+             { return x * b + k; });
+
+    // A neuron's formula as three nodes, and fused into one
+    bench_op(results, "neuron", 0.5f, [&](Value &x)
+             {
+        auto z = x * b;
+        return (z + k).tanh(); });
+    bench_op(results, "neuron_fused", 0.5f, [&](Value &x)
+             { return fuse((expr(x) * b + k).tanh()); });
+}
+
+// Constructing a large MLP on one thread and on every core
+void bench_init(std::vector<Result> &results)
+{
+    std::vector<size_t> thread_counts = {1};
+    if (std::thread::hardware_concurrency() > 1)
+    {
+        thread_counts.push_back(std::thread::hardware_concurrency());
+    }
+
+    for (size_t num_threads : thread_counts)
+    {
+        double ns = time_ns(3, [&]()
+                            { MLP(64, {256, 256, 256, 1}, Initializer(Init::He, 1), num_threads); });
+        results.push_back({"init/mlp/64-256-256-256-1/threads=" + std::to_string(num_threads), ns, "ns", false});
+    }
+}
+
+void bench_alloc(std::vector<Result> &results)
+{
+    const size_t n = 100000;
+    std::vector<Value> values;
+    values.reserve(n);
+
+    double ns = time_ns(5, [&]()
+                        {
+        values.clear();
+        for (size_t i = 0; i < n; i++)
+        {
+            values.emplace_back(Value(static_cast<Value::value_type>(i)));
+        } });
+
+    results.push_back({"alloc/leaf", n / (ns * 1e-9), "nodes/s", true});
+}
+
+// backward() over dot products of increasing size. A dot of n elements has
+// 2n op nodes on top of its 2n leaves.
+void bench_backward_scaling(std::vector<Result> &results)
+{
+    for (size_t n : {100, 1000, 10000, 100000})
+    {
+        std::vector<Value> a;
+        std::vector<Value> b;
+        a.reserve(n);
+        b.reserve(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            a.emplace_back(Value(1.0f));
+            b.emplace_back(Value(1.0f));
+        }
+        auto out = dot(a, b);
+
+        double ns = time_ns(3, [&]()
+                            { out.backward(1, true); });
+
+        results.push_back({"backward/dot/n=" + std::to_string(n), ns, "ns", false});
+        results.push_back({"backward/dot/n=" + std::to_string(n) + "/per_node", ns / (4 * n), "ns/node", false});
+    }
+}
+
+// backward() over a wide graph on one thread and on every core: 256 chains of
+// 100 tanh(h * w) steps over a shared w, summed
+void bench_backward_parallel(std::vector<Result> &results)
+{
+    std::vector<size_t> thread_counts = {1};
+    if (std::thread::hardware_concurrency() > 1)
+    {
+        thread_counts.push_back(std::thread::hardware_concurrency());
+    }
+
+    auto w = Value(0.5f);
+    Value out = 0;
+    for (size_t i = 0; i < 256; i++)
+    {
+        auto h = Value(static_cast<Value::value_type>(i) / 256);
+        for (size_t k = 0; k < 100; k++)
+        {
+            h = (h * w).tanh();
+        }
+        out += h;
+    }
+
+    for (size_t num_threads : thread_counts)
+    {
+        double ns = time_ns(3, [&]()
+                            { out.backward(num_threads, true); });
+        results.push_back({"backward/wide/threads=" + std::to_string(num_threads), ns, "ns", false});
+    }
+}
+
+#ifdef MICROGRAD_LAZY
+// Scalar code over Neurons, a layer of 64 with 64 inputs on 8 samples, run
+// eagerly and recorded lazily so that each level runs as batch kernels
+void bench_lazy(std::vector<Result> &results)
+{
+    const size_t nin = 64;
+    std::vector<Neuron> neurons;
+    for (size_t j = 0; j < 64; j++)
+    {
+        neurons.push_back(Neuron(nin, true, Initializer(Init::He, 1), j * (nin + 1), 64));
+    }
+    std::mt19937 gen(1234);
+    std::uniform_real_distribution<float> dist(-1.0, 1.0);
+    std::vector<std::vector<float>> xs(8, std::vector<float>(nin));
+    for (auto &x : xs)
+    {
+        std::generate(x.begin(), x.end(), [&]()
+                      { return dist(gen); });
+    }
+
+    auto step = [&]()
+    {
+        Value loss = 0;
+        for (auto &x : xs)
+        {
+            for (auto &n : neurons)
+            {
+                loss += n(x).square();
+            }
+        }
+        loss.backward();
+    };
+
+    double eager = time_ns(3, step);
+    results.push_back({"lazy/neurons/eager", eager, "ns", false});
+
+    double lazy = time_ns(3, [&]()
+                          {
+        ScopedLazyEvaluation scope;
+        step(); });
+    results.push_back({"lazy/neurons/batched", lazy, "ns", false});
+}
+#endif
+
+// Throughput of the array versions of each approximation in each math mode,
+// and of batched inference, whose tanh goes through them
+void bench_activations(std::vector<Result> &results)
+{
+    const size_t n = 1 << 16;
+    std::mt19937 gen(1234);
+    std::uniform_real_distribution<float> dist(-4.0, 4.0);
+    std::vector<float> x(n);
+    std::generate(x.begin(), x.end(), [&]()
+                  { return dist(gen); });
+    std::vector<float> positive(n);
+    std::transform(x.begin(), x.end(), positive.begin(), [](float v)
+                   { return std::abs(v) + 1e-3f; });
+    std::vector<float> y(n);
+
+    struct Function
+    {
+        std::string name;
+        void (*fn)(const float *, float *, size_t, MathMode);
+        const std::vector<float> &x;
+    };
+    std::vector<Function> functions = {
+        {"tanh", approx_tanh, x},
+        {"exp", approx_exp, x},
+        {"log", approx_log, positive},
+        {"sigmoid", approx_sigmoid, x},
+    };
+    std::vector<std::pair<std::string, MathMode>> modes = {
+        {"exact", MathMode::Exact},
+        {"fast", MathMode::Fast},
+        {"ultra_fast", MathMode::UltraFast},
+    };
+
+    for (auto &f : functions)
+    {
+        for (auto &[mode_name, mode] : modes)
+        {
+            double ns = time_ns(20, [&]()
+                                { f.fn(f.x.data(), y.data(), n, mode); });
+            results.push_back({"activation/" + f.name + "/" + mode_name, n / ns * 1e3, "Melem/s", true});
+        }
+    }
+
+    auto model = MLP(16, {64, 64, 1}, Initializer(Init::Xavier, 1));
+    std::vector<std::vector<float>> xs(256, std::vector<float>(16));
+    for (auto &sample : xs)
+    {
+        std::generate(sample.begin(), sample.end(), [&]()
+                      { return dist(gen); });
+    }
+    for (auto &[mode_name, mode] : modes)
+    {
+        ScopedMathMode scope(mode);
+        double ns = time_ns(10, [&]()
+                            { model.predict(xs); });
+        results.push_back({"activation/predict/16-64-64-1/" + mode_name, xs.size() / (ns * 1e-9), "samples/s", true});
+    }
+}
+
+// One step of the training loop from main.cpp
+void train_step(MLP &model, std::vector<std::vector<float>> &xs, std::vector<float> &ys, float lr)
+{
+    auto loss = Value::constant(0.0);
+    for (size_t i = 0; i < xs.size(); i++)
+    {
+        auto ypred = model(xs[i]);
+        Value sub = ypred[0] - ys[i];
+        loss += sub.square();
+    }
+
+    model.zero_grad();
+    loss.backward();
+
+    for (auto &p : model.trainable_parameters())
+    {
+        p.data() += -(p.grad() * lr);
+    }
+}
+
+void bench_training(std::vector<Result> &results)
+{
+    struct Shape
+    {
+        size_t nin;
+        std::vector<size_t> nouts;
+        size_t steps;
+    };
+
+    std::vector<Shape> shapes = {
+        {3, {4, 4, 1}, 200},
+        {8, {16, 16, 1}, 30},
+        {16, {32, 32, 1}, 10},
+    };
+
+    std::mt19937 gen(1234);
+    std::uniform_real_distribution<float> dist(-1.0, 1.0);
+
+    for (auto &shape : shapes)
+    {
+        std::vector<std::vector<float>> xs(4, std::vector<float>(shape.nin));
+        std::vector<float> ys(xs.size());
+        for (size_t i = 0; i < xs.size(); i++)
+        {
+            std::generate(xs[i].begin(), xs[i].end(), [&]()
+                          { return dist(gen); });
+            ys[i] = dist(gen) > 0 ? 1.0f : -1.0f;
+        }
+
+        auto model = MLP(shape.nin, shape.nouts);
+
+        double ns = time_ns(1, [&]()
+                            {
+            for (size_t step = 0; step < shape.steps; step++)
+            {
+                train_step(model, xs, ys, 0.05);
+            } });
+
+        std::stringstream name;
+        name << "train/mlp/" << shape.nin;
+        for (auto v : shape.nouts)
+        {
+            name << "-" << v;
+        }
+        results.push_back({name.str(), shape.steps / (ns * 1e-9), "steps/s", true});
+    }
+}
+
+// Training with graph nodes and weights from the heap against pools over
+// transparent huge pages
+void bench_memory(std::vector<Result> &results)
+{
+    const size_t nin = 64;
+    const size_t steps = 3;
+
+    std::mt19937 gen(1234);
+    std::uniform_real_distribution<float> dist(-1.0, 1.0);
+    std::vector<std::vector<float>> xs(4, std::vector<float>(nin));
+    std::vector<float> ys(xs.size());
+    for (size_t i = 0; i < xs.size(); i++)
+    {
+        std::generate(xs[i].begin(), xs[i].end(), [&]()
+                      { return dist(gen); });
+        ys[i] = dist(gen) > 0 ? 1.0f : -1.0f;
+    }
+
+    auto run = [&]()
+    {
+        auto model = MLP(nin, {256, 256, 1}, Initializer(Init::He, 1));
+        // Once untimed, so that the pools hold a step's worth of memory
+        train_step(model, xs, ys, 0.01);
+        return time_ns(1, [&]()
+                       {
+            for (size_t step = 0; step < steps; step++)
+            {
+                train_step(model, xs, ys, 0.01);
+            } });
+    };
+
+    double heap = run();
+    results.push_back({"train/memory/heap", steps / (heap * 1e-9), "steps/s", true});
+
+    auto huge = HugePageResource(HugePages::Transparent);
+    auto pool = std::pmr::synchronized_pool_resource(&huge);
+    ScopedMemoryResources scope({&pool, &pool});
+    double huge_pages = run();
+    results.push_back({"train/memory/huge_pages", steps / (huge_pages * 1e-9), "steps/s", true});
+}
+
+// Heap bytes in use, graphs included
+size_t heap_bytes()
+{
+    auto info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+// Graph memory of a deep MLP's training loop, with backward() retaining the
+// graph and releasing it as it goes. The loss is kept until the next one is
+// built, as a loop that logs it does, so a retained graph is still resident
+// while the next forward runs.
+void bench_backward_memory(std::vector<Result> &results)
+{
+    const size_t nin = 16;
+    const std::vector<size_t> nouts = {32, 32, 32, 32, 32, 32, 32, 32, 1};
+    const size_t steps = 3;
+
+    std::mt19937 gen(1234);
+    std::uniform_real_distribution<float> dist(-1.0, 1.0);
+    std::vector<std::vector<float>> xs(8, std::vector<float>(nin));
+    std::vector<float> ys(xs.size());
+    for (size_t i = 0; i < xs.size(); i++)
+    {
+        std::generate(xs[i].begin(), xs[i].end(), [&]()
+                      { return dist(gen); });
+        ys[i] = dist(gen) > 0 ? 1.0f : -1.0f;
+    }
+    auto model = MLP(nin, nouts, Initializer(Init::He, 1));
+
+    auto forward = [&]()
+    {
+        Value loss = 0;
+        for (size_t i = 0; i < xs.size(); i++)
+        {
+            loss += (model(xs[i])[0] - ys[i]).square();
+        }
+        return loss;
+    };
+
+    for (bool retain : {true, false})
+    {
+        size_t base = heap_bytes();
+        size_t peak = 0;
+        size_t after_backward = 0;
+        Value loss = forward();
+        for (size_t step = 0; step < steps; step++)
+        {
+            model.zero_grad();
+            loss.backward(1, retain);
+            after_backward = heap_bytes() - base;
+
+            Value next = forward();
+            peak = std::max(peak, heap_bytes() - base);
+            loss = next;
+        }
+
+        std::string mode = retain ? "retain" : "release";
+        results.push_back({"memory/backward/" + mode + "/peak", static_cast<double>(peak), "bytes", false});
+        results.push_back({"memory/backward/" + mode + "/after_backward", static_cast<double>(after_backward), "bytes", false});
+    }
+}
+
+// A Hessian-vector product against a plain gradient on the same loss
+void bench_hvp(std::vector<Result> &results)
+{
+    auto model = MLP(16, {32, 32, 1}, Initializer(Init::He, 1));
+    auto params = model.parameters();
+    std::vector<float> x(16, 0.5f);
+    std::vector<float> v(params.size(), 0.01f);
+    std::vector<float> hv;
+
+    double backward = time_ns(3, [&]()
+                              {
+        auto loss = (model(x)[0] - 1.0f).square();
+        loss.backward(); });
+    results.push_back({"grad/mlp/16-32-32-1/backward", backward, "ns", false});
+
+    double product = time_ns(3, [&]()
+                             {
+        auto loss = (model(x)[0] - 1.0f).square();
+        hvp(loss, params, v, hv); });
+    results.push_back({"grad/mlp/16-32-32-1/hvp", product, "ns", false});
+}
+
+// Evaluating a model on a batch again after changing one input or one weight:
+// building the graph from scratch against updating the graph in place
+void bench_incremental(std::vector<Result> &results)
+{
+    auto model = MLP(16, {64, 64, 1}, Initializer(Init::He, 1));
+    auto params = model.parameters();
+    std::mt19937 gen(1234);
+    std::uniform_real_distribution<float> dist(-1.0, 1.0);
+    std::vector<std::vector<Value>> xs(32);
+    for (auto &x : xs)
+    {
+        for (size_t i = 0; i < 16; i++)
+        {
+            x.push_back(Value(dist(gen)));
+        }
+    }
+
+    auto forward = [&]()
+    {
+        Value loss = 0;
+        for (auto &x : xs)
+        {
+            loss += model(x)[0].square();
+        }
+        return loss;
+    };
+
+    double rebuild = time_ns(3, [&]()
+                             { forward(); });
+    results.push_back({"incremental/mlp/16-64-64-1/rebuild", rebuild, "ns", false});
+
+    auto loss = forward();
+    auto inc = Incremental({loss});
+    const size_t reps = 100;
+    size_t input_nodes = 0;
+    double input = time_ns(3, [&]()
+                           {
+        for (size_t r = 0; r < reps; r++)
+        {
+            inc.set(xs[r % xs.size()][r % 16], dist(gen));
+            inc.update();
+            input_nodes = inc.recomputed;
+        } });
+    results.push_back({"incremental/mlp/16-64-64-1/input", input / reps, "ns", false});
+    results.push_back({"incremental/mlp/16-64-64-1/input/nodes", double(input_nodes), "nodes", false});
+
+    size_t weight_nodes = 0;
+    double weight = time_ns(3, [&]()
+                            {
+        for (size_t r = 0; r < reps; r++)
+        {
+            auto &p = params[r % 16];
+            inc.set(p, p.data() + 1e-3f);
+            inc.update();
+            weight_nodes = inc.recomputed;
+        } });
+    results.push_back({"incremental/mlp/16-64-64-1/weight", weight / reps, "ns", false});
+    results.push_back({"incremental/mlp/16-64-64-1/weight/nodes", double(weight_nodes), "nodes", false});
+    results.push_back({"incremental/mlp/16-64-64-1/graph/nodes", double(inc.order.size()), "nodes", false});
+}
+
+// Fine-tuning only the last layer of a deep model against training all of it.
+// Frozen layers on constant inputs fold away, so backward only walks the
+// last layer's graph.
+void bench_finetune(std::vector<Result> &results)
+{
+    const size_t nin = 16;
+    const std::vector<size_t> nouts = {32, 32, 32, 32, 1};
+    const size_t steps = 5;
+
+    std::mt19937 gen(1234);
+    std::uniform_real_distribution<float> dist(-1.0, 1.0);
+    std::vector<std::vector<float>> xs(4, std::vector<float>(nin));
+    std::vector<float> ys(xs.size());
+    for (size_t i = 0; i < xs.size(); i++)
+    {
+        std::generate(xs[i].begin(), xs[i].end(), [&]()
+                      { return dist(gen); });
+        ys[i] = dist(gen) > 0 ? 1.0f : -1.0f;
+    }
+
+    auto model = MLP(nin, nouts);
+    for (bool frozen : {false, true})
+    {
+        for (size_t i = 0; i + 1 < model.layers.size(); i++)
+        {
+            model.layers[i].freeze(frozen);
+        }
+
+        double ns = time_ns(1, [&]()
+                            {
+            for (size_t step = 0; step < steps; step++)
+            {
+                train_step(model, xs, ys, 0.05);
+            } });
+        results.push_back({frozen ? "train/finetune/last_layer" : "train/finetune/all_layers", steps / (ns * 1e-9), "steps/s", true});
+    }
+}
+
+// Gradient of every sample in a batch: one backward() per sample graph against
+// MLP::per_sample_gradients
+void bench_per_sample_gradients(std::vector<Result> &results)
+{
+    const size_t nin = 16;
+    const size_t batch = 32;
+
+    std::mt19937 gen(1234);
+    std::uniform_real_distribution<float> dist(-1.0, 1.0);
+    std::vector<std::vector<float>> xs(batch, std::vector<float>(nin));
+    std::vector<float> ys(batch);
+    for (size_t i = 0; i < batch; i++)
+    {
+        std::generate(xs[i].begin(), xs[i].end(), [&]()
+                      { return dist(gen); });
+        ys[i] = dist(gen) > 0 ? 1.0f : -1.0f;
+    }
+
+    auto model = MLP(nin, {32, 32, 1});
+    auto params = model.parameters();
+
+    double graph = time_ns(1, [&]()
+                           {
+        std::vector<std::vector<float>> grads(batch, std::vector<float>(params.size()));
+        for (size_t b = 0; b < batch; b++)
+        {
+            Value sub = model(xs[b])[0] - ys[b];
+            auto loss = sub.square();
+            model.zero_grad();
+            loss.backward();
+            for (size_t i = 0; i < params.size(); i++)
+            {
+                grads[b][i] = params[i].grad();
+            }
+        } });
+
+    double batched = time_ns(5, [&]()
+                             {
+        auto preds = model.predict(xs);
+        std::vector<float> dys(batch);
+        for (size_t b = 0; b < batch; b++)
+        {
+            dys[b] = 2 * (preds[b][0] - ys[b]);
+        }
+        model.per_sample_gradients(xs, dys); });
+
+    results.push_back({"per_sample_grad/graph/batch=32", graph, "ns", false});
+    results.push_back({"per_sample_grad/batched/batch=32", batched, "ns", false});
+}
+
+// Deep model trained sequentially and with the layers split across pipeline
+// stages. Only shows a speedup with at least as many cores as stages.
+void bench_pipeline(std::vector<Result> &results)
+{
+    const size_t nin = 8;
+    const std::vector<size_t> nouts = {16, 16, 16, 16, 16, 1};
+    const size_t steps = 10;
+
+    std::mt19937 gen(1234);
+    std::uniform_real_distribution<float> dist(-1.0, 1.0);
+    std::vector<std::vector<float>> xs(8, std::vector<float>(nin));
+    std::vector<float> ys(xs.size());
+    for (size_t i = 0; i < xs.size(); i++)
+    {
+        std::generate(xs[i].begin(), xs[i].end(), [&]()
+                      { return dist(gen); });
+        ys[i] = dist(gen) > 0 ? 1.0f : -1.0f;
+    }
+
+    auto model = MLP(nin, nouts);
+    double ns = time_ns(1, [&]()
+                        {
+        for (size_t step = 0; step < steps; step++)
+        {
+            train_step(model, xs, ys, 0.05);
+        } });
+    results.push_back({"train/pipeline/stages=1", steps / (ns * 1e-9), "steps/s", true});
+
+    for (size_t num_stages : {2, 3})
+    {
+        auto pipe = PipelineTrainer(model, num_stages, 2);
+        double ns = time_ns(1, [&]()
+                            {
+            for (size_t step = 0; step < steps; step++)
+            {
+                pipe.step(xs, ys, 0.05);
+            } });
+        results.push_back({"train/pipeline/stages=" + std::to_string(num_stages), steps / (ns * 1e-9), "steps/s", true});
+    }
+}
+
+// A batch of category ids through an embedding vs the same ids as one-hot
+// vectors through a linear Layer, forward, backward and SGD update
+void bench_embedding(std::vector<Result> &results)
+{
+    const size_t vocab = 10000;
+    const size_t dim = 16;
+    const size_t batch = 32;
+    const size_t steps = 5;
+
+    std::mt19937 gen(1234);
+    std::uniform_int_distribution<size_t> dist(0, vocab - 1);
+    std::vector<size_t> ids(batch);
+    std::generate(ids.begin(), ids.end(), [&]()
+                  { return dist(gen); });
+
+    auto emb = Embedding(vocab, dim);
+    double sparse = time_ns(1, [&]()
+                            {
+        for (size_t step = 0; step < steps; step++)
+        {
+            auto e = emb(ids);
+            auto loss = dot(e, e);
+            loss.backward();
+            emb.update(0.01);
+        } });
+    results.push_back({"train/embedding/sparse/vocab=10000", steps / (sparse * 1e-9), "steps/s", true});
+
+    auto layer = Layer(vocab, dim, false);
+    auto params = layer.parameters();
+    double dense = time_ns(1, [&]()
+                           {
+        for (size_t step = 0; step < steps; step++)
+        {
+            auto loss = Value::constant(0.0);
+            for (auto id : ids)
+            {
+                std::vector<float> one_hot(vocab);
+                one_hot[id] = 1;
+                auto x = to_values(one_hot);
+                auto e = layer(x);
+                loss += dot(e, e);
+            }
+            loss.backward();
+            for (auto &p : params)
+            {
+                p.data() += -(p.grad() * 0.01f);
+                p.grad() = 0;
+            }
+        } });
+    results.push_back({"train/embedding/one_hot/vocab=10000", steps / (dense * 1e-9), "steps/s", true});
+}
+
+void write_json(std::ostream &out, const std::vector<Result> &results)
+{
+    out << "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        auto &r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"value\": " << std::setprecision(6) << r.value
+            << ", \"unit\": \"" << r.unit << "\", \"higher_is_better\": " << (r.higher_is_better ? "true" : "false") << "}";
+        out << (i < results.size() - 1 ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+// Reads results written by write_json(). This is not a general JSON parser: it
+// expects one benchmark object per line, which is what write_json() produces.
+// Returns false if the file can't be opened or holds no results.
+bool read_json(const std::string &filename, std::vector<Result> &results)
+{
+    std::ifstream file(filename);
+    if (!file)
+    {
+        std::cerr << "Could not open baseline file: " << filename << std::endl;
+        return false;
+    }
+
+    std::regex re("\\{\"name\": \"([^\"]*)\", \"value\": ([^,]+), \"unit\": \"([^\"]*)\", \"higher_is_better\": (true|false)\\}");
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::smatch m;
+        if (std::regex_search(line, m, re))
+        {
+            std::string value = m[2];
+            char *end = nullptr;
+            double v = std::strtod(value.c_str(), &end);
+            if (end != value.c_str() + value.size())
+            {
+                std::cerr << "Bad value in baseline file: " << filename << ": " << line << std::endl;
+                return false;
+            }
+            results.push_back({m[1], v, m[3], m[4] == "true"});
+        }
+    }
+    if (results.empty())
+    {
+        std::cerr << "No results in baseline file: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Prints a comparison table to stderr and returns the number of regressions
+size_t compare(const std::vector<Result> &results, const std::vector<Result> &baseline, double threshold)
+{
+    size_t regressions = 0;
+    for (auto &r : results)
+    {
+        auto it = std::find_if(baseline.begin(), baseline.end(), [&](const Result &b)
+                               { return b.name == r.name; });
+        if (it == baseline.end())
+        {
+            std::cerr << std::left << std::setw(32) << r.name << " (no baseline)" << std::endl;
+            continue;
+        }
+
+        // Positive change is always an improvement
+        double change = (r.value - it->value) / it->value;
+        if (!r.higher_is_better)
+        {
+            change = -change;
+        }
+
+        bool regressed = change < -threshold;
+        regressions += regressed;
+
+        std::cerr << std::left << std::setw(32) << r.name << std::right << std::setw(14) << it->value
+                  << " -> " << std::setw(14) << r.value << " " << std::setw(8) << r.unit << " "
+                  << std::showpos << std::fixed << std::setprecision(1) << change * 100 << "%"
+                  << std::noshowpos << std::defaultfloat << std::setprecision(6)
+                  << (regressed ? "  REGRESSION" : "") << std::endl;
+    }
+    return regressions;
+}
+
+void usage(const char *argv0)
+{
+    std::cerr << "Usage: " << argv0 << " [--out FILE] [--baseline FILE] [--threshold PERCENT]\n"
+              << "  --out FILE          write results as JSON to FILE instead of stdout\n"
+              << "  --baseline FILE     compare against results from a previous run\n"
+              << "  --threshold PERCENT allowed slowdown before flagging a regression (default 10)\n"
+              << "Exits 1 on a regression and 2 if the baseline can't be read.\n";
+}
+
+int main(int argc, char **argv)
+{
+    std::string out_filename;
+    std::string baseline_filename;
+    double threshold = 0.10;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--out" && i + 1 < argc)
+        {
+            out_filename = argv[++i];
+        }
+        else if (arg == "--baseline" && i + 1 < argc)
+        {
+            baseline_filename = argv[++i];
+        }
+        else if (arg == "--threshold" && i + 1 < argc)
+        {
+            threshold = std::stod(argv[++i]) / 100;
+        }
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    // Read first, so a bad baseline fails before the benchmarks run
+    std::vector<Result> baseline;
+    if (!baseline_filename.empty() && !read_json(baseline_filename, baseline))
+    {
+        return 2;
+    }
+
+    std::vector<Result> results;
+    bench_ops(results);
+    bench_alloc(results);
+    bench_init(results);
+    bench_backward_scaling(results);
+    bench_backward_parallel(results);
+#ifdef MICROGRAD_LAZY
+    bench_lazy(results);
+#endif
+    bench_activations(results);
+    bench_training(results);
+    bench_memory(results);
+    bench_backward_memory(results);
+    bench_hvp(results);
+    bench_incremental(results);
+    bench_finetune(results);
+    bench_per_sample_gradients(results);
+    bench_pipeline(results);
+    bench_embedding(results);
+
+    if (out_filename.empty())
+    {
+        write_json(std::cout, results);
+    }
+    else
+    {
+        std::ofstream file(out_filename);
+        write_json(file, results);
+    }
+
+    if (!baseline_filename.empty())
+    {
+        size_t regressions = compare(results, baseline, threshold);
+        if (regressions > 0)
+        {
+            std::cerr << regressions << " benchmark(s) regressed by more than " << threshold * 100 << "%" << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
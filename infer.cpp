@@ -0,0 +1,40 @@
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+// Only the runtime: no engine, no graph, no shared_ptrs
+#include <micrograd/runtime.hpp>
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " MODEL.mgir X0 X1 ...\n"
+                  << "  Runs a graph exported with export_ir() on one input and prints its outputs\n";
+        return 2;
+    }
+
+    IrProgram program;
+    if (!program.load(argv[1]))
+    {
+        std::cerr << "Failed to load " << argv[1] << std::endl;
+        return 1;
+    }
+
+    std::vector<float> x;
+    for (int i = 2; i < argc; i++)
+    {
+        x.push_back(std::strtof(argv[i], nullptr));
+    }
+    if (x.size() != program.num_inputs)
+    {
+        std::cerr << "Expected " << program.num_inputs << " inputs, got " << x.size() << std::endl;
+        return 1;
+    }
+
+    for (auto y : program.forward(x))
+    {
+        std::cout << y << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <micrograd/serve.hpp>
+
+void usage(const char *argv0)
+{
+    std::cerr << "Usage: " << argv0 << " SOCKET [--clients C] [--inflight K] [--requests N] [--nin NIN]\n"
+              << "  --clients C    concurrent connections (default 4)\n"
+              << "  --inflight K   requests each connection keeps outstanding (default 8)\n"
+              << "  --requests N   requests sent per connection (default 10000)\n"
+              << "  --nin NIN      inputs per request, must match the served model (default 3)\n";
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::string path = argv[1];
+    size_t clients = 4;
+    size_t inflight = 8;
+    size_t requests = 10000;
+    size_t nin = 3;
+
+    for (int i = 2; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--clients" && i + 1 < argc)
+        {
+            clients = std::stoul(argv[++i]);
+        }
+        else if (arg == "--inflight" && i + 1 < argc)
+        {
+            inflight = std::stoul(argv[++i]);
+        }
+        else if (arg == "--requests" && i + 1 < argc)
+        {
+            requests = std::stoul(argv[++i]);
+        }
+        else if (arg == "--nin" && i + 1 < argc)
+        {
+            nin = std::stoul(argv[++i]);
+        }
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    using Clock = std::chrono::steady_clock;
+    std::mutex mutex;
+    LatencyWindow latencies(clients * requests);
+    size_t failures = 0;
+
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (size_t c = 0; c < clients; c++)
+    {
+        threads.emplace_back([&, c]()
+                             {
+            InferenceClient client(path);
+            if (!client.ok())
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                failures += requests;
+                return;
+            }
+
+            std::mt19937 gen(c);
+            std::uniform_real_distribution<float> dist(-1.0, 1.0);
+            std::vector<float> x(nin);
+            std::unordered_map<uint32_t, Clock::time_point> sent;
+            std::vector<double> mine;
+            mine.reserve(requests);
+
+            uint32_t next = 0;
+            auto send_one = [&]()
+            {
+                std::generate(x.begin(), x.end(), [&]()
+                              { return dist(gen); });
+                sent[next] = Clock::now();
+                return client.send(next++, x);
+            };
+
+            bool ok = true;
+            while (ok && next < std::min(inflight, requests))
+            {
+                ok = send_one();
+            }
+
+            std::vector<float> y;
+            while (ok && !sent.empty())
+            {
+                uint32_t id;
+                ok = client.receive(id, y);
+                auto it = sent.find(id);
+                if (!ok || it == sent.end())
+                {
+                    ok = false;
+                    break;
+                }
+                mine.push_back(std::chrono::duration<double, std::micro>(Clock::now() - it->second).count());
+                sent.erase(it);
+                if (next < requests)
+                {
+                    ok = send_one();
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto us : mine)
+            {
+                latencies.add(us);
+            }
+            failures += requests - mine.size(); });
+    }
+
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    size_t done = latencies.samples.size();
+    std::cout << "clients " << clients << " inflight " << inflight << "\n"
+              << "requests " << done << " failed " << failures << " in " << seconds << "s\n"
+              << "throughput " << done / seconds << " req/s\n"
+              << "client latency p50 " << latencies.percentile(0.50) << "us p99 " << latencies.percentile(0.99) << "us\n";
+
+    InferenceClient client(path);
+    ServerStats s;
+    if (client.ok() && client.stats(s))
+    {
+        std::cout << "server requests " << s.requests << " batches " << s.batches
+                  << " mean batch " << (s.batches > 0 ? static_cast<double>(s.requests) / s.batches : 0)
+                  << " p50 " << s.p50_us << "us p99 " << s.p99_us << "us\n";
+    }
+
+    return failures == 0 ? 0 : 1;
+}
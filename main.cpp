@@ -1,9 +1,10 @@
 
 #include <micrograd/engine.hpp>
 #include <micrograd/graphviz.hpp>
+#include <micrograd/ir.hpp>
 #include <micrograd/nn.hpp>
 
-void train()
+void train(const std::string &export_path)
 {
     std::vector<std::vector<float>> xs = {
         {2.0f, 3.0f, -1.0f},
@@ -29,14 +30,14 @@ void train()
             ypred.push_back(n(x));
         }
 
-        Value loss(0.0);
+        auto loss = Value::constant(0.0);
 
         for (size_t i = 0; i < ypred.size(); i++)
         {
             float ygt = ys[i];
             Value yout = ypred[i][0];
             Value sub = yout - ygt;
-            loss += (sub * sub);
+            loss += sub.square();
         }
 
 #ifndef NO_GRAPHVIZ
@@ -55,7 +56,7 @@ void train()
         n.zero_grad();
         loss.backward();
 
-        for (auto &p : n.parameters())
+        for (auto &p : n.trainable_parameters())
         {
             p.data() += -(p.grad() * lr);
         }
@@ -68,10 +69,34 @@ void train()
     }
     std::cout << "\nypred:\n"
               << ypred << "\n";
+
+    // One forward of the trained model, for the standalone runtime in infer.cpp
+    if (!export_path.empty())
+    {
+        auto x = trace_inputs(xs[0]);
+        auto y = n(x);
+        export_ir(y, x, export_path);
+    }
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
-    train();
+    std::string export_path;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--export" && i + 1 < argc)
+        {
+            export_path = argv[++i];
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--export MODEL.mgir]\n"
+                      << "  Trains a small MLP, and writes it for infer with --export\n";
+            return 2;
+        }
+    }
+
+    train(export_path);
     return 0;
 }
\ No newline at end of file
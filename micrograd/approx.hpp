@@ -0,0 +1,319 @@
+#pragma once
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+// Approximations of the transcendental functions behind tanh, exp, pow and
+// sigmoid, in three accuracy modes. The max errors below are measured against
+// the double-precision result rounded to float, over every 11th float in
+// tanh [-20, 20], exp [-87, 88], log [1e-37, 1e37] and sigmoid [-40, 40]:
+//
+//                 tanh       exp        log        sigmoid
+//     Exact       2 ULP      1 ULP      1 ULP      2 ULP
+//     Fast        1 ULP      1 ULP      1 ULP      2 ULP
+//     UltraFast   3134 ULP   1266 ULP   8703 ULP   1267 ULP
+//
+// Exact calls std::. Fast reduces the argument and evaluates a polynomial good
+// to float precision. UltraFast uses polynomials of half the degree, about
+// 1e-4 relative error (3e-4 absolute for log), which is plenty for an
+// activation that feeds SGD. Neither needs a table or a libm call, and the
+// array versions are loops the compiler vectorizes. What they give up is the
+// edges: results below FLT_MIN lose precision, and UltraFast's exp(0) is
+// 0.99992.
+
+enum class MathMode
+{
+    Exact,
+    Fast,
+    UltraFast,
+};
+
+// The mode the engine's ops use on the calling thread. Threads start in Exact;
+// the library's own workers (the backward pool, pipeline stages, the server's
+// batch thread) take the mode of the thread that started them.
+MathMode &math_mode()
+{
+    thread_local MathMode mode = MathMode::Exact;
+    return mode;
+}
+
+// Replaces the math mode until the end of the scope
+struct ScopedMathMode
+{
+    MathMode saved;
+
+    ScopedMathMode(MathMode mode) : saved(math_mode())
+    {
+        math_mode() = mode;
+    }
+
+    ScopedMathMode(const ScopedMathMode &) = delete;
+    ScopedMathMode &operator=(const ScopedMathMode &) = delete;
+
+    ~ScopedMathMode()
+    {
+        math_mode() = saved;
+    }
+};
+
+// c ? a : b, in integer ops. Written as a conditional, GCC would rather
+// specialize what follows for a constant a or b, and the branch that leaves
+// stops it from vectorizing the loop around (a float op that may trap can't be
+// made unconditional).
+inline float select(bool c, float a, float b)
+{
+    int32_t mask = -static_cast<int32_t>(c);
+    return std::bit_cast<float>((std::bit_cast<int32_t>(a) & mask) | (std::bit_cast<int32_t>(b) & ~mask));
+}
+
+// exp(x) = 2^n exp(r), with n = round(x / ln 2) and |r| <= ln 2 / 2
+template <MathMode M>
+inline float approx_exp(float x)
+{
+    if constexpr (M == MathMode::Exact)
+    {
+        return std::exp(x);
+    }
+    else
+    {
+        // Past the ends the result is inf or 0 anyway; the clamp keeps n in
+        // range of the scaling below. A NaN passes through to p.
+        float xc = select(x < -104.0f, -104.0f, x);
+        xc = select(x > 89.0f, 89.0f, xc);
+        // Round to nearest by adding 1.5 * 2^23, which leaves n in the low
+        // bits of t
+        float t = xc * 1.44269504f + 12582912.0f;
+        float n = t - 12582912.0f;
+        // r = x - n ln 2, with ln 2 split so n * hi is exact
+        float r = xc - n * 0.693359375f;
+        r = r + n * 2.12194440e-4f;
+
+        float p;
+        if constexpr (M == MathMode::Fast)
+        {
+            p = 1.9875691500e-4f;
+            p = p * r + 1.3981999507e-3f;
+            p = p * r + 8.3334519073e-3f;
+            p = p * r + 4.1665795894e-2f;
+            p = p * r + 1.6666665459e-1f;
+            p = p * r + 5.0000001201e-1f;
+            p = p * r * r + r + 1.0f;
+        }
+        else
+        {
+            p = 0.16767012f;
+            p = p * r + 0.50502228f;
+            p = p * r + 0.99998493f;
+            p = p * r + 0.99992456f;
+        }
+
+        // 2^n as two factors, since n may be out of range of one float exponent
+        int32_t ni = std::bit_cast<int32_t>(t) - 0x4b400000;
+        int32_t n1 = ni >> 1;
+        int32_t n2 = ni - n1;
+        float s1 = std::bit_cast<float>((n1 + 127) << 23);
+        float s2 = std::bit_cast<float>((n2 + 127) << 23);
+        return p * s1 * s2;
+    }
+}
+
+// log(x) = e ln 2 + log(1 + f), with sqrt(1/2) <= 1 + f < sqrt(2)
+template <MathMode M>
+inline float approx_log(float x)
+{
+    if constexpr (M == MathMode::Exact)
+    {
+        return std::log(x);
+    }
+    else
+    {
+        // Scale denormals up so the exponent field is meaningful
+        bool denormal = x < std::numeric_limits<float>::min();
+        float xs = x * select(denormal, 8388608.0f, 1.0f);
+        int32_t bits = std::bit_cast<int32_t>(xs);
+        int32_t e = ((bits >> 23) & 0xff) - 126 - (denormal ? 23 : 0);
+        // m in [0.5, 1)
+        float m = std::bit_cast<float>((bits & 0x007fffff) | 0x3f000000);
+        bool low = m < 0.70710678f;
+        e = low ? e - 1 : e;
+        float f = select(low, m + m, m) - 1.0f;
+        float fe = static_cast<float>(e);
+
+        float z = f * f;
+        float y;
+        if constexpr (M == MathMode::Fast)
+        {
+            float p = 7.0376836292e-2f;
+            p = p * f - 1.1514610310e-1f;
+            p = p * f + 1.1676998740e-1f;
+            p = p * f - 1.2420140846e-1f;
+            p = p * f + 1.4249322787e-1f;
+            p = p * f - 1.6668057665e-1f;
+            p = p * f + 2.0000714765e-1f;
+            p = p * f - 2.4999993993e-1f;
+            p = p * f + 3.3333331174e-1f;
+            y = p * f * z;
+            y = y - 2.12194440e-4f * fe;
+            y = y - 0.5f * z;
+            y = f + y;
+            y = y + 0.693359375f * fe;
+        }
+        else
+        {
+            float p = -0.22994082f;
+            p = p * f + 0.34935733f;
+            p = p * f - 0.50100333f;
+            y = f + z * p + 0.69314718f * fe;
+        }
+
+        y = select(x == std::numeric_limits<float>::infinity(), x, y);
+        y = select(x == 0.0f, -std::numeric_limits<float>::infinity(), y);
+        return select(!(x >= 0.0f), std::numeric_limits<float>::quiet_NaN(), y);
+    }
+}
+
+// tanh(x) is odd; a polynomial near 0, where 1 - 2 / (exp(2x) + 1) would cancel
+template <MathMode M>
+inline float approx_tanh(float x)
+{
+    if constexpr (M == MathMode::Exact)
+    {
+        return std::tanh(x);
+    }
+    else
+    {
+        float ax = std::fabs(x);
+        float z = x * x;
+        float small;
+        if constexpr (M == MathMode::Fast)
+        {
+            float p = -5.70498872745e-3f;
+            p = p * z + 2.06390887954e-2f;
+            p = p * z - 5.37397155531e-2f;
+            p = p * z + 1.33314422036e-1f;
+            p = p * z - 3.33332819422e-1f;
+            small = p * z * x + x;
+        }
+        else
+        {
+            float p = 0.11482286f;
+            p = p * z - 0.33244704f;
+            small = p * z * x + x;
+        }
+        float large = 1.0f - 2.0f / (approx_exp<M>(2.0f * ax) + 1.0f);
+        large = std::copysign(large, x);
+        return select(ax < 0.625f, small, large);
+    }
+}
+
+template <MathMode M>
+inline float approx_sigmoid(float x)
+{
+    if constexpr (M == MathMode::Exact)
+    {
+        return 1.0f / (1.0f + std::exp(-x));
+    }
+    else
+    {
+        return 1.0f / (1.0f + approx_exp<M>(-x));
+    }
+}
+
+// a^b as exp(b log a) for a > 0, so its error grows with |b log a|; std::pow
+// for the rest, where the sign or a zero needs care
+template <MathMode M>
+inline float approx_pow(float a, float b)
+{
+    if constexpr (M == MathMode::Exact)
+    {
+        return std::pow(a, b);
+    }
+    else
+    {
+        return a > 0.0f ? approx_exp<M>(b * approx_log<M>(a)) : std::pow(a, b);
+    }
+}
+
+// Runtime dispatch on a mode, for a single value
+
+#define MICROGRAD_APPROX_SCALAR(name)                   \
+    inline float name(float x, MathMode mode)           \
+    {                                                   \
+        switch (mode)                                   \
+        {                                               \
+        case MathMode::Fast:                            \
+            return name<MathMode::Fast>(x);             \
+        case MathMode::UltraFast:                       \
+            return name<MathMode::UltraFast>(x);        \
+        default:                                        \
+            return name<MathMode::Exact>(x);            \
+        }                                               \
+    }
+
+MICROGRAD_APPROX_SCALAR(approx_exp)
+MICROGRAD_APPROX_SCALAR(approx_log)
+MICROGRAD_APPROX_SCALAR(approx_tanh)
+MICROGRAD_APPROX_SCALAR(approx_sigmoid)
+
+inline float approx_pow(float a, float b, MathMode mode)
+{
+    switch (mode)
+    {
+    case MathMode::Fast:
+        return approx_pow<MathMode::Fast>(a, b);
+    case MathMode::UltraFast:
+        return approx_pow<MathMode::UltraFast>(a, b);
+    default:
+        return approx_pow<MathMode::Exact>(a, b);
+    }
+}
+
+// And for arrays. y may be x. The loop goes through a small buffer so the
+// compiler can vectorize it without proving that x and y don't overlap.
+
+template <float (*F)(float)>
+void approx_array(const float *x, float *y, size_t n)
+{
+    constexpr size_t width = 16;
+    float buffer[width];
+    size_t i = 0;
+    for (; i + width <= n; i += width)
+    {
+        for (size_t k = 0; k < width; k++)
+        {
+            buffer[k] = F(x[i + k]);
+        }
+        for (size_t k = 0; k < width; k++)
+        {
+            y[i + k] = buffer[k];
+        }
+    }
+    for (; i < n; i++)
+    {
+        y[i] = F(x[i]);
+    }
+}
+
+#define MICROGRAD_APPROX_ARRAY(name)                                 \
+    inline void name(const float *x, float *y, size_t n, MathMode mode) \
+    {                                                                \
+        switch (mode)                                                \
+        {                                                            \
+        case MathMode::Fast:                                         \
+            return approx_array<name<MathMode::Fast>>(x, y, n);      \
+        case MathMode::UltraFast:                                    \
+            return approx_array<name<MathMode::UltraFast>>(x, y, n); \
+        default:                                                     \
+            return approx_array<name<MathMode::Exact>>(x, y, n);     \
+        }                                                            \
+    }
+
+MICROGRAD_APPROX_ARRAY(approx_exp)
+MICROGRAD_APPROX_ARRAY(approx_log)
+MICROGRAD_APPROX_ARRAY(approx_tanh)
+MICROGRAD_APPROX_ARRAY(approx_sigmoid)
+
+#undef MICROGRAD_APPROX_SCALAR
+#undef MICROGRAD_APPROX_ARRAY
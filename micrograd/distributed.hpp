@@ -0,0 +1,314 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <micrograd/engine.hpp>
+
+// Control block at the start of the shared segment
+struct SharedMemoryHeader
+{
+    std::atomic<uint32_t> arrived{0};
+    std::atomic<uint32_t> generation{0};
+    // Set by the launcher when a rank dies, so the others stop waiting for it
+    std::atomic<uint32_t> aborted{0};
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "barrier needs lock-free atomics to work across processes");
+
+// A group of processes on one host sharing a POSIX shared-memory segment with
+// one buffer of `capacity` floats per rank. Create it before launching the
+// workers: the mapping is inherited through fork() and the name is unlinked
+// right away, so nothing is left behind in /dev/shm if a process crashes.
+struct SharedMemoryGroup
+{
+    size_t world_size;
+    size_t capacity;
+    size_t rank = 0;
+    size_t bytes = 0;
+    SharedMemoryHeader *header = nullptr;
+    float *slots = nullptr;
+
+    SharedMemoryGroup(size_t world_size, size_t capacity, const std::string &name = "/micrograd-" + std::to_string(getpid()))
+        : world_size(world_size), capacity(capacity)
+    {
+        assert(world_size > 0);
+        // Keep the buffers on their own cache lines
+        size_t header_bytes = (sizeof(SharedMemoryHeader) + 63) / 64 * 64;
+        bytes = header_bytes + world_size * capacity * sizeof(float);
+
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+        {
+            std::cerr << "shm_open(" << name << ") failed: " << std::strerror(errno) << std::endl;
+            return;
+        }
+        shm_unlink(name.c_str());
+
+        if (ftruncate(fd, bytes) != 0)
+        {
+            std::cerr << "ftruncate failed: " << std::strerror(errno) << std::endl;
+            close(fd);
+            return;
+        }
+
+        void *mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED)
+        {
+            std::cerr << "mmap failed: " << std::strerror(errno) << std::endl;
+            return;
+        }
+
+        header = new (mem) SharedMemoryHeader();
+        slots = reinterpret_cast<float *>(static_cast<char *>(mem) + header_bytes);
+    }
+
+    SharedMemoryGroup(const SharedMemoryGroup &) = delete;
+    SharedMemoryGroup &operator=(const SharedMemoryGroup &) = delete;
+
+    ~SharedMemoryGroup()
+    {
+        if (header != nullptr)
+        {
+            munmap(header, bytes);
+        }
+    }
+
+    bool ok() const { return header != nullptr; }
+
+    float *slot(size_t r) { return slots + r * capacity; }
+
+    // Sense-reversing barrier over all ranks. Returns false if the group was
+    // aborted because another rank died.
+    bool barrier()
+    {
+        auto gen = header->generation.load(std::memory_order_acquire);
+        if (header->arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == world_size)
+        {
+            header->arrived.store(0, std::memory_order_relaxed);
+            header->generation.fetch_add(1, std::memory_order_acq_rel);
+        }
+        else
+        {
+            while (header->generation.load(std::memory_order_acquire) == gen)
+            {
+                if (header->aborted.load(std::memory_order_relaxed))
+                {
+                    return false;
+                }
+                std::this_thread::yield();
+            }
+        }
+        return header->aborted.load(std::memory_order_relaxed) == 0;
+    }
+
+    // Sums `values` over all ranks in place with a ring allreduce: a
+    // reduce-scatter leaves each rank with one fully summed chunk, then an
+    // allgather passes the summed chunks around the ring. Each step only reads
+    // the left neighbour's buffer, and a barrier separates the steps.
+    bool allreduce_sum(std::vector<float> &values)
+    {
+        assert(values.size() <= capacity);
+        const size_t n = values.size();
+        const size_t w = world_size;
+        float *mine = slot(rank);
+        float *left = slot((rank + w - 1) % w);
+
+        auto chunk_begin = [&](size_t c)
+        { return c * n / w; };
+        auto chunk_end = [&](size_t c)
+        { return (c + 1) * n / w; };
+
+        std::copy(values.begin(), values.end(), mine);
+        if (!barrier())
+        {
+            return false;
+        }
+
+        for (size_t s = 0; s + 1 < w; s++)
+        {
+            size_t c = (rank + 2 * w - s - 1) % w;
+            for (size_t i = chunk_begin(c); i < chunk_end(c); i++)
+            {
+                mine[i] += left[i];
+            }
+            if (!barrier())
+            {
+                return false;
+            }
+        }
+
+        for (size_t s = 0; s + 1 < w; s++)
+        {
+            size_t c = (rank + w - s) % w;
+            std::copy(left + chunk_begin(c), left + chunk_end(c), mine + chunk_begin(c));
+            if (!barrier())
+            {
+                return false;
+            }
+        }
+
+        std::copy(mine, mine + n, values.begin());
+        // Nobody may overwrite their buffer until everyone has copied out
+        return barrier();
+    }
+
+    bool allreduce_mean(std::vector<float> &values)
+    {
+        if (!allreduce_sum(values))
+        {
+            return false;
+        }
+        for (auto &v : values)
+        {
+            v /= world_size;
+        }
+        return true;
+    }
+
+    // Copies `values` from rank `root` to every other rank
+    bool broadcast(std::vector<float> &values, size_t root = 0)
+    {
+        assert(values.size() <= capacity);
+        if (rank == root)
+        {
+            std::copy(values.begin(), values.end(), slot(root));
+        }
+        if (!barrier())
+        {
+            return false;
+        }
+        if (rank != root)
+        {
+            std::copy(slot(root), slot(root) + values.size(), values.begin());
+        }
+        return barrier();
+    }
+};
+
+// Forks one process per rank and runs fn in each of them. The calling process
+// only supervises: if a rank exits with an error or is killed, the group is
+// aborted so that the remaining ranks fail out of their next barrier instead of
+// hanging. Returns 0 if every rank returned 0. A rank may run a parallel
+// backward(): the backward pool starts over in each child.
+int launch(SharedMemoryGroup &group, const std::function<int(SharedMemoryGroup &)> &fn)
+{
+    if (!group.ok())
+    {
+        return 1;
+    }
+
+    // Anything still buffered would otherwise be printed once per rank
+    std::cout.flush();
+
+    std::vector<pid_t> pids;
+    for (size_t r = 0; r < group.world_size; r++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            std::cerr << "fork failed: " << std::strerror(errno) << std::endl;
+            group.header->aborted.store(1);
+            break;
+        }
+        if (pid == 0)
+        {
+            group.rank = r;
+            int rc = fn(group);
+            std::cout.flush();
+            _exit(rc);
+        }
+        pids.push_back(pid);
+    }
+
+    // Only the ranks forked here are waited on, so children the host spawned
+    // for other reasons are left alone. They are polled rather than waited on
+    // in turn, so that a rank that fails is noticed while the others still run.
+    int result = pids.size() == group.world_size ? 0 : 1;
+    while (!pids.empty())
+    {
+        bool reaped = false;
+        for (size_t i = 0; i < pids.size();)
+        {
+            int status = 0;
+            pid_t done = waitpid(pids[i], &status, WNOHANG);
+            if (done == 0 || (done < 0 && errno == EINTR))
+            {
+                i++;
+                continue;
+            }
+            if (done < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                group.header->aborted.store(1);
+                result = 1;
+            }
+            pids.erase(pids.begin() + i);
+            reaped = true;
+        }
+        if (!reaped && !pids.empty())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    return result;
+}
+
+std::vector<float> gradients_of(const std::vector<Value> &params)
+{
+    std::vector<float> out;
+    out.reserve(params.size());
+    for (auto &p : params)
+    {
+        out.push_back(p.grad());
+    }
+    return out;
+}
+
+// Averages the gradients of a replica's parameters over all ranks
+bool allreduce_gradients(SharedMemoryGroup &group, std::vector<Value> &params)
+{
+    auto grads = gradients_of(params);
+    if (!group.allreduce_mean(grads))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < params.size(); i++)
+    {
+        params[i].grad() = grads[i];
+    }
+    return true;
+}
+
+// Makes every replica start from rank 0's parameters
+bool broadcast_parameters(SharedMemoryGroup &group, std::vector<Value> &params)
+{
+    std::vector<float> data;
+    data.reserve(params.size());
+    for (auto &p : params)
+    {
+        data.push_back(p.data());
+    }
+    if (!group.broadcast(data))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < params.size(); i++)
+    {
+        params[i].data() = data[i];
+    }
+    return true;
+}
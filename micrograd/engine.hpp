@@ -1,341 +1,1315 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <iostream>
 #include <vector>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <pthread.h>
+
+#include <micrograd/approx.hpp>
+#include <micrograd/memory.hpp>
 
 struct Context
 {
     using value_type = float;
-    value_type data;
-    value_type grad = 0;
+    // data and grad normally refer to these. Parameters that live in a Layer's
+    // weight matrix refer into the matrix instead.
+    value_type own_data;
+    value_type own_grad = 0;
+    value_type &data;
+    value_type &grad;
     std::string label;
     std::string op;
+    // False for constants and inputs. Such nodes never receive a gradient and
+    // backward() does not visit them.
+    bool requires_grad = true;
+    // Set by release() on an op's node. Its grad is still that of the
+    // backward() that released it, but it has no edges left to walk.
+    bool released = false;
+    // Scalar operand of ops such as "+c" and "*c", which keep it here rather
+    // than in a constant node
+    value_type scalar = 0;
     std::function<void()> backward = []() {};
     std::vector<std::shared_ptr<Context>> prev;
+    // State of an op beyond data and prev, e.g. the weights behind a "layer"
+    // node, for tools that inspect the graph
+    std::shared_ptr<void> attrs;
+    // Which output of a multi-output op this node is
+    size_t index = 0;
+    // The lock a parallel backward() takes to add into grad: grad_lock, or for
+    // a parameter whose grad lives in a shared array, the lock of that array
+    std::atomic_flag *grad_guard = &grad_lock;
+    // Also taken around this node's backward, by an op that adds into such an
+    // array itself
+    std::atomic_flag *backward_guard = nullptr;
+    // Held by a parallel backward() while a consumer adds into grad
+    std::atomic_flag grad_lock;
+#ifdef MICROGRAD_LAZY
+    // Level of a node recorded by lazy evaluation whose data is not computed
+    // yet: one more than its deepest pending input. 0 once data is valid.
+    // Next to grad_lock, it takes no space of its own.
+    uint32_t lazy_depth = 0;
+#endif
 
-    Context(value_type data) : data(data) {}
-    Context(value_type data, const std::string &label) : data(data), label(label) {}
+    Context(value_type data) : own_data(data), data(own_data), grad(own_grad) {}
+    Context(value_type data, const std::string &label) : own_data(data), data(own_data), grad(own_grad), label(label) {}
     Context(value_type data, std::initializer_list<std::shared_ptr<Context>> &&prev, const std::string &op)
-        : data(data), op(op), prev(prev)
+        : own_data(data), data(own_data), grad(own_grad), op(op), prev(prev)
+    {
+    }
+    Context(value_type data, std::vector<std::shared_ptr<Context>> &&prev, const std::string &op)
+        : own_data(data), data(own_data), grad(own_grad), op(op), prev(std::move(prev))
+    {
+    }
+
+    // data and grad refer to external storage, which must outlive the Context
+    Context(value_type &data, value_type &grad, const std::string &label)
+        : own_data(0), data(data), grad(grad), label(label)
+    {
+    }
+
+    // A copy would refer to the original's storage
+    Context(const Context &) = delete;
+    Context &operator=(const Context &) = delete;
+
+    // Drops what only backward needs: the closure, the edges to the inputs and
+    // the op's saved state. The node keeps its data and grad.
+    void release()
+    {
+        // A leaf has nothing to release and stays usable
+        released = released || !prev.empty() || attrs != nullptr;
+        backward = []() {};
+        std::vector<std::shared_ptr<Context>>().swap(prev);
+        attrs.reset();
+    }
+
+    // Releases the graph behind this node with an explicit stack. Letting
+    // each prev release the next would recurse once per node, and a long
+    // chain such as a large dot product would overflow the stack.
+    ~Context()
     {
+        std::vector<std::shared_ptr<Context>> stack = std::move(prev);
+        while (!stack.empty())
+        {
+            auto node = std::move(stack.back());
+            stack.pop_back();
+            if (node.use_count() == 1)
+            {
+                for (auto &p : node->prev)
+                {
+                    stack.push_back(std::move(p));
+                }
+                node->prev.clear();
+            }
+        }
     }
 };
 
-auto operator+(std::shared_ptr<Context> &lhs, std::shared_ptr<Context> &rhs)
+// Reports a walk by `who` that reached a node released by an earlier
+// backward() without retain_graph. Returns false if it did.
+bool check_not_released(const Context &ctx, const char *who)
 {
-    auto ptr = new Context(lhs->data + rhs->data, {lhs, rhs}, "+");
-    auto out = std::shared_ptr<Context>(ptr);
-    out->backward = [out, lhs, rhs]()
+    if (ctx.released)
     {
-        lhs->grad += out->grad;
-        rhs->grad += out->grad;
-    };
+        std::cerr << who << ": the graph was released by an earlier backward(), "
+                  << "pass retain_graph to walk it again" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Allocates a node from the current thread's graph resource
+template <typename... Args>
+std::shared_ptr<Context> new_context(Args &&...args)
+{
+    if (memory_resources().graph == nullptr)
+    {
+        return std::make_shared<Context>(std::forward<Args>(args)...);
+    }
+    return std::allocate_shared<Context>(std::pmr::polymorphic_allocator<Context>(memory_resources().graph), std::forward<Args>(args)...);
+}
+
+// Forward of each op on one element: b is the second operand of a binary op or
+// the scalar of a scalar op, and is ignored by unary ops. Eager ops apply them
+// to one node, lazy evaluation to a batch of nodes at a time.
+
+struct AddKernel
+{
+    static Context::value_type apply(Context::value_type a, Context::value_type b) { return a + b; }
+};
+
+struct SubKernel
+{
+    static Context::value_type apply(Context::value_type a, Context::value_type b) { return a - b; }
+};
+
+struct MulKernel
+{
+    static Context::value_type apply(Context::value_type a, Context::value_type b) { return a * b; }
+};
+
+struct DivKernel
+{
+    static Context::value_type apply(Context::value_type a, Context::value_type b) { return a / b; }
+};
+
+struct PowKernel
+{
+    static Context::value_type apply(Context::value_type a, Context::value_type b) { return approx_pow(a, b, math_mode()); }
+};
+
+struct TanhKernel
+{
+    static Context::value_type apply(Context::value_type a, Context::value_type) { return approx_tanh(a, math_mode()); }
+};
+
+struct ExpKernel
+{
+    static Context::value_type apply(Context::value_type a, Context::value_type) { return approx_exp(a, math_mode()); }
+};
+
+struct LogKernel
+{
+    static Context::value_type apply(Context::value_type a, Context::value_type) { return approx_log(a, math_mode()); }
+};
+
+struct NegKernel
+{
+    static Context::value_type apply(Context::value_type a, Context::value_type) { return -a; }
+};
+
+struct SquareKernel
+{
+    static Context::value_type apply(Context::value_type a, Context::value_type) { return a * a; }
+};
+
+struct ReciprocalKernel
+{
+    static Context::value_type apply(Context::value_type a, Context::value_type) { return 1 / a; }
+};
+
+#ifdef MICROGRAD_LAZY
+using BatchKernel = void (*)(const Context::value_type *a, const Context::value_type *b, Context::value_type *out, size_t n);
+
+// A kernel over arrays, a loop the compiler can vectorize
+template <typename K>
+void batch_kernel(const Context::value_type *a, const Context::value_type *b, Context::value_type *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        out[i] = K::apply(a[i], b[i]);
+    }
+}
+
+// Those that dispatch on math_mode() do so once per batch
+template <>
+void batch_kernel<TanhKernel>(const Context::value_type *a, const Context::value_type *, Context::value_type *out, size_t n)
+{
+    approx_tanh(a, out, n, math_mode());
+}
+
+template <>
+void batch_kernel<ExpKernel>(const Context::value_type *a, const Context::value_type *, Context::value_type *out, size_t n)
+{
+    approx_exp(a, out, n, math_mode());
+}
+
+// Lazy evaluation, compiled in with -DMICROGRAD_LAZY. While a thread records,
+// ops that need a gradient create their node without computing it. The first read of such a node's data (or a
+// backward()) evaluates everything recorded so far, one level at a time:
+// nodes at the same depth don't depend on each other, so all those of the
+// same op run as one batch kernel.
+//
+// Nodes are filed into their level's batch as they are recorded, and each
+// operand whose data is already valid is copied into the batch's arrays then,
+// while it is still in cache. Only operands that are pending themselves are
+// read at evaluation, once their level has run. The arrays are kept between
+// evaluations, so a training loop records into memory it already has.
+
+// The nodes of one op at one level
+struct LazyBatch
+{
+    BatchKernel kernel;
+    // The math mode when the nodes were recorded, which they run in
+    MathMode mode;
+    std::vector<std::shared_ptr<Context>> out;
+    // Operands, b being the scalar of an op with one input
+    std::vector<Context::value_type> a;
+    std::vector<Context::value_type> b;
+    // Operands that were pending when recorded: (slot, node) pairs
+    std::vector<std::pair<uint32_t, const Context *>> late_a;
+    std::vector<std::pair<uint32_t, const Context *>> late_b;
+
+    void clear()
+    {
+        out.clear();
+        a.clear();
+        b.clear();
+        late_a.clear();
+        late_b.clear();
+    }
+};
+
+// What this thread has recorded and not evaluated yet. levels[d] holds the
+// batches of depth d, levels[0] is unused.
+struct LazyRecord
+{
+    std::vector<std::vector<LazyBatch>> levels;
+    size_t size = 0;
+    std::vector<Context::value_type> out;
+
+    bool empty() const { return size == 0; }
+
+    void add(std::shared_ptr<Context> ctx, BatchKernel kernel, const Context *a, const Context *b, Context::value_type scalar)
+    {
+        const uint32_t depth = ctx->lazy_depth;
+        const MathMode mode = math_mode();
+        if (levels.size() <= depth)
+        {
+            levels.resize(depth + 1);
+        }
+        // A level rarely holds more than a few ops
+        auto &batches = levels[depth];
+        auto it = std::find_if(batches.begin(), batches.end(), [&](const LazyBatch &batch)
+                               { return (batch.kernel == kernel && batch.mode == mode) || batch.out.empty(); });
+        if (it == batches.end())
+        {
+            it = batches.insert(batches.end(), LazyBatch{kernel, mode});
+        }
+        auto &batch = *it;
+        batch.kernel = kernel;
+        batch.mode = mode;
+
+        const uint32_t slot = batch.out.size();
+        batch.a.push_back(a->data);
+        if (a->lazy_depth != 0)
+        {
+            batch.late_a.push_back({slot, a});
+        }
+        batch.b.push_back(b != nullptr ? b->data : scalar);
+        if (b != nullptr && b->lazy_depth != 0)
+        {
+            batch.late_b.push_back({slot, b});
+        }
+        batch.out.push_back(std::move(ctx));
+        size++;
+    }
+
+    void evaluate()
+    {
+        for (size_t d = 1; d < levels.size() && size > 0; d++)
+        {
+            for (auto &batch : levels[d])
+            {
+                const size_t n = batch.out.size();
+                if (n == 0)
+                {
+                    continue;
+                }
+                for (auto [slot, node] : batch.late_a)
+                {
+                    batch.a[slot] = node->data;
+                }
+                for (auto [slot, node] : batch.late_b)
+                {
+                    batch.b[slot] = node->data;
+                }
+                out.resize(n);
+                ScopedMathMode scope(batch.mode);
+                batch.kernel(batch.a.data(), batch.b.data(), out.data(), n);
+                for (size_t i = 0; i < n; i++)
+                {
+                    batch.out[i]->data = out[i];
+                    batch.out[i]->lazy_depth = 0;
+                }
+                batch.clear();
+                size -= n;
+            }
+        }
+    }
+};
+
+bool &lazy_recording()
+{
+    thread_local bool recording = false;
+    return recording;
+}
+
+LazyRecord &lazy_record()
+{
+    thread_local LazyRecord record;
+    return record;
+}
+
+void evaluate_lazy()
+{
+    auto &record = lazy_record();
+    if (!record.empty())
+    {
+        record.evaluate();
+    }
+}
+
+// Records ops lazily until the end of the scope, which evaluates them
+struct ScopedLazyEvaluation
+{
+    bool saved;
+
+    ScopedLazyEvaluation() : saved(lazy_recording())
+    {
+        lazy_recording() = true;
+    }
+
+    ScopedLazyEvaluation(const ScopedLazyEvaluation &) = delete;
+    ScopedLazyEvaluation &operator=(const ScopedLazyEvaluation &) = delete;
+
+    ~ScopedLazyEvaluation()
+    {
+        lazy_recording() = saved;
+        evaluate_lazy();
+    }
+};
+#else
+// Without lazy evaluation every node's data is computed when it is created
+void evaluate_lazy()
+{
+}
+#endif
+
+// Creates the output node of an op with kernel K. If none of the inputs
+// require a gradient the result is folded into a constant: it keeps no edges
+// and never gets a backward. Otherwise it is computed now, or recorded if the
+// thread is recording. A constant's inputs are constants too, so they are
+// never pending.
+//
+// Backward closures capture raw pointers to the output and its inputs. The
+// output owns its inputs through prev and is alive whenever its backward
+// runs, so a node never owns itself and graphs are freed once unreferenced.
+template <typename K>
+std::shared_ptr<Context> make_result(const std::shared_ptr<Context> &a, Context::value_type scalar, const std::string &op)
+{
+    auto out = new_context(0);
+    out->scalar = scalar;
+    if (a->requires_grad)
+    {
+        out->op = op;
+        out->prev.push_back(a);
+#ifdef MICROGRAD_LAZY
+        if (lazy_recording())
+        {
+            out->lazy_depth = a->lazy_depth + 1;
+            lazy_record().add(out, batch_kernel<K>, a.get(), nullptr, scalar);
+            return out;
+        }
+#endif
+    }
+    else
+    {
+        out->requires_grad = false;
+    }
+    out->data = K::apply(a->data, scalar);
     return out;
 }
 
-auto operator*(std::shared_ptr<Context> &lhs, std::shared_ptr<Context> &rhs)
+template <typename K>
+std::shared_ptr<Context> make_result(const std::shared_ptr<Context> &a, const std::shared_ptr<Context> &b, const std::string &op)
 {
-    auto ptr = new Context(lhs->data * rhs->data, {lhs, rhs}, "*");
-    auto out = std::shared_ptr<Context>(ptr);
-    out->backward = [out, lhs, rhs]()
+    auto out = new_context(0);
+    if (a->requires_grad || b->requires_grad)
     {
-        lhs->grad += rhs->data * out->grad;
-        rhs->grad += lhs->data * out->grad;
-    };
+        out->op = op;
+        out->prev.reserve(2);
+        out->prev.push_back(a);
+        out->prev.push_back(b);
+#ifdef MICROGRAD_LAZY
+        if (lazy_recording())
+        {
+            out->lazy_depth = std::max(a->lazy_depth, b->lazy_depth) + 1;
+            lazy_record().add(out, batch_kernel<K>, a.get(), b.get(), 0);
+            return out;
+        }
+#endif
+    }
+    else
+    {
+        out->requires_grad = false;
+    }
+    out->data = K::apply(a->data, b->data);
     return out;
 }
 
-auto tanh(std::shared_ptr<Context> &lhs)
+auto operator+(const std::shared_ptr<Context> &lhs, const std::shared_ptr<Context> &rhs)
 {
-    auto ptr = new Context(std::tanh(lhs->data), {lhs}, "tanh");
-    auto out = std::shared_ptr<Context>(ptr);
-    out->backward = [out, lhs]()
+    auto out = make_result<AddKernel>(lhs, rhs, "+");
+    if (out->requires_grad)
     {
-        lhs->grad += (1 - out->data * out->data) * out->grad;
-    };
+        out->backward = [out = out.get(), lhs = lhs.get(), rhs = rhs.get()]()
+        {
+            if (lhs->requires_grad)
+            {
+                lhs->grad += out->grad;
+            }
+            if (rhs->requires_grad)
+            {
+                rhs->grad += out->grad;
+            }
+        };
+    }
     return out;
 }
 
-auto exp(std::shared_ptr<Context> &lhs)
+auto operator*(const std::shared_ptr<Context> &lhs, const std::shared_ptr<Context> &rhs)
 {
-    auto ptr = new Context(std::exp(lhs->data), {lhs}, "exp");
-    auto out = std::shared_ptr<Context>(ptr);
-    out->backward = [out, lhs]()
+    auto out = make_result<MulKernel>(lhs, rhs, "*");
+    if (out->requires_grad)
     {
-        lhs->grad += out->data * out->grad;
-    };
+        out->backward = [out = out.get(), lhs = lhs.get(), rhs = rhs.get()]()
+        {
+            if (lhs->requires_grad)
+            {
+                lhs->grad += rhs->data * out->grad;
+            }
+            if (rhs->requires_grad)
+            {
+                rhs->grad += lhs->data * out->grad;
+            }
+        };
+    }
     return out;
 }
 
-auto pow(std::shared_ptr<Context> &lhs, std::shared_ptr<Context> &rhs)
+auto tanh(const std::shared_ptr<Context> &lhs)
 {
-    auto ptr = new Context(std::pow(lhs->data, rhs->data), {lhs, rhs}, "pow");
-    auto out = std::shared_ptr<Context>(ptr);
-    out->backward = [out, lhs, rhs]()
+    auto out = make_result<TanhKernel>(lhs, 0, "tanh");
+    if (out->requires_grad)
     {
-        lhs->grad += rhs->data * std::pow(lhs->data, rhs->data - 1) * out->grad;
-    };
+        out->backward = [out = out.get(), lhs = lhs.get()]()
+        {
+            lhs->grad += (1 - out->data * out->data) * out->grad;
+        };
+    }
     return out;
 }
 
-void backward(std::shared_ptr<Context> &root)
+auto exp(const std::shared_ptr<Context> &lhs)
 {
-    std::unordered_set<std::shared_ptr<Context>> visited;
-    std::queue<std::shared_ptr<Context>> q;
+    auto out = make_result<ExpKernel>(lhs, 0, "exp");
+    if (out->requires_grad)
+    {
+        out->backward = [out = out.get(), lhs = lhs.get()]()
+        {
+            lhs->grad += out->data * out->grad;
+        };
+    }
+    return out;
+}
 
-    q.push(root);
-    visited.insert(root);
-    root->grad = 1;
+// The natural log, real for lhs > 0. grad() needs it for the exponent of pow.
+auto log(const std::shared_ptr<Context> &lhs)
+{
+    auto out = make_result<LogKernel>(lhs, 0, "log");
+    if (out->requires_grad)
+    {
+        out->backward = [out = out.get(), lhs = lhs.get()]()
+        {
+            lhs->grad += out->grad / lhs->data;
+        };
+    }
+    return out;
+}
 
-    while (q.size() > 0)
+// d/d(rhs) of lhs^rhs is lhs^rhs * ln(lhs), which is only real for lhs > 0.
+// The exponent gets no gradient from a base <= 0.
+auto pow(const std::shared_ptr<Context> &lhs, const std::shared_ptr<Context> &rhs)
+{
+    auto out = make_result<PowKernel>(lhs, rhs, "pow");
+    if (out->requires_grad)
     {
-        auto ctx = q.front();
-        q.pop();
-        ctx->backward();
+        out->backward = [out = out.get(), lhs = lhs.get(), rhs = rhs.get()]()
+        {
+            if (lhs->requires_grad)
+            {
+                lhs->grad += rhs->data * approx_pow(lhs->data, rhs->data - 1, math_mode()) * out->grad;
+            }
+            if (rhs->requires_grad && lhs->data > 0)
+            {
+                rhs->grad += out->data * approx_log(lhs->data, math_mode()) * out->grad;
+            }
+        };
+    }
+    return out;
+}
 
-        for (auto &child : ctx->prev)
+auto operator-(const std::shared_ptr<Context> &lhs, const std::shared_ptr<Context> &rhs)
+{
+    auto out = make_result<SubKernel>(lhs, rhs, "-");
+    if (out->requires_grad)
+    {
+        out->backward = [out = out.get(), lhs = lhs.get(), rhs = rhs.get()]()
         {
-            if (!visited.contains(child))
+            if (lhs->requires_grad)
             {
-                q.push(child);
-                visited.insert(child);
+                lhs->grad += out->grad;
             }
-        }
+            if (rhs->requires_grad)
+            {
+                rhs->grad -= out->grad;
+            }
+        };
     }
+    return out;
 }
 
-struct Value
+auto operator/(const std::shared_ptr<Context> &lhs, const std::shared_ptr<Context> &rhs)
 {
-    using value_type = Context::value_type;
-    std::shared_ptr<Context> ctx_;
+    auto out = make_result<DivKernel>(lhs, rhs, "/");
+    if (out->requires_grad)
+    {
+        out->backward = [out = out.get(), lhs = lhs.get(), rhs = rhs.get()]()
+        {
+            if (lhs->requires_grad)
+            {
+                lhs->grad += out->grad / rhs->data;
+            }
+            if (rhs->requires_grad)
+            {
+                rhs->grad -= out->data / rhs->data * out->grad;
+            }
+        };
+    }
+    return out;
+}
 
-    Value(value_type data) : ctx_(std::make_shared<Context>(data)) {}
-    Value(value_type data, const std::string &label) : ctx_(std::make_shared<Context>(data, label)) {}
-    Value(std::shared_ptr<Context> &&ctx) : ctx_(ctx) {}
+auto neg(const std::shared_ptr<Context> &lhs)
+{
+    auto out = make_result<NegKernel>(lhs, 0, "neg");
+    if (out->requires_grad)
+    {
+        out->backward = [out = out.get(), lhs = lhs.get()]()
+        {
+            lhs->grad -= out->grad;
+        };
+    }
+    return out;
+}
 
-    Value operator+(Value &rhs)
+auto square(const std::shared_ptr<Context> &lhs)
+{
+    auto out = make_result<SquareKernel>(lhs, 0, "square");
+    if (out->requires_grad)
     {
-        return Value(ctx_ + rhs.ctx_);
+        out->backward = [out = out.get(), lhs = lhs.get()]()
+        {
+            lhs->grad += 2 * lhs->data * out->grad;
+        };
     }
+    return out;
+}
 
-    Value operator+(Value &&rhs)
+auto reciprocal(const std::shared_ptr<Context> &lhs)
+{
+    auto out = make_result<ReciprocalKernel>(lhs, 0, "reciprocal");
+    if (out->requires_grad)
     {
-        return *this + rhs;
+        out->backward = [out = out.get(), lhs = lhs.get()]()
+        {
+            lhs->grad -= out->data * out->data * out->grad;
+        };
     }
+    return out;
+}
 
-    Value operator+(value_type rhs)
+// Ops with a scalar constant operand: one node instead of a constant leaf
+// plus the op
+
+auto operator+(const std::shared_ptr<Context> &lhs, Context::value_type rhs)
+{
+    auto out = make_result<AddKernel>(lhs, rhs, "+c");
+    if (out->requires_grad)
     {
-        return *this + Value(rhs);
+        out->backward = [out = out.get(), lhs = lhs.get()]()
+        {
+            lhs->grad += out->grad;
+        };
     }
+    return out;
+}
 
-    Value operator+(value_type &&rhs)
+auto operator*(const std::shared_ptr<Context> &lhs, Context::value_type rhs)
+{
+    auto out = make_result<MulKernel>(lhs, rhs, "*c");
+    if (out->requires_grad)
     {
-        return *this + rhs;
+        out->backward = [out = out.get(), lhs = lhs.get()]()
+        {
+            lhs->grad += out->scalar * out->grad;
+        };
     }
+    return out;
+}
 
-    Value &operator+=(Value &rhs)
+auto pow(const std::shared_ptr<Context> &lhs, Context::value_type rhs)
+{
+    auto out = make_result<PowKernel>(lhs, rhs, "^c");
+    if (out->requires_grad)
+    {
+        out->backward = [out = out.get(), lhs = lhs.get()]()
+        {
+            lhs->grad += out->scalar * approx_pow(lhs->data, out->scalar - 1, math_mode()) * out->grad;
+        };
+    }
+    return out;
+}
+
+// Threads kept between parallel backward() calls. run(n, fn) calls fn(0) ..
+// fn(n - 1) at once, fn(0) on the calling thread, and returns when all are
+// done. Idle threads sleep on a condition variable.
+struct ThreadPool
+{
+    std::mutex run_mutex;
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    std::vector<std::thread> threads;
+    const std::function<void(size_t)> *job = nullptr;
+    size_t job_size = 0;
+    // The caller's math mode, which the job runs in on every thread
+    MathMode job_mode = MathMode::Exact;
+    size_t running = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    ThreadPool() = default;
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool()
     {
-        if (this != &rhs)
         {
-            ctx_ = std::shared_ptr<Context>(ctx_ + rhs.ctx_);
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        start_cv.notify_all();
+        for (auto &t : threads)
+        {
+            t.join();
         }
-        return *this;
     }
 
-    Value &operator+=(Value &&rhs)
+    void run(size_t n, const std::function<void(size_t)> &fn)
     {
-        return *this += rhs;
+        // One job at a time
+        std::lock_guard<std::mutex> run_lock(run_mutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while (threads.size() + 1 < n)
+            {
+                threads.emplace_back([this, self = threads.size() + 1]()
+                                     { loop(self); });
+            }
+            job = &fn;
+            job_size = n;
+            job_mode = math_mode();
+            running = n - 1;
+            generation++;
+        }
+        start_cv.notify_all();
+
+        fn(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [this]()
+                     { return running == 0; });
+        job = nullptr;
     }
 
-    Value &operator+=(value_type rhs)
+    void loop(size_t self)
     {
-        return *this += Value(rhs);
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            start_cv.wait(lock, [&]()
+                          { return stopping || generation != seen; });
+            if (stopping)
+            {
+                return;
+            }
+            seen = generation;
+            if (self >= job_size)
+            {
+                continue;
+            }
+            auto fn = job;
+            ScopedMathMode scope(job_mode);
+            lock.unlock();
+            (*fn)(self);
+            lock.lock();
+            if (--running == 0)
+            {
+                done_cv.notify_one();
+            }
+        }
     }
+};
+
+// fork() copies the pool but none of its threads, so a child that ran a
+// parallel backward() on the copy would wait for them forever. The child
+// abandons the copy instead and starts a pool of its own.
+ThreadPool &backward_pool()
+{
+    static ThreadPool *pool = []()
+    {
+        pthread_atfork(nullptr, nullptr, []()
+                       { pool = new ThreadPool; });
+        return new ThreadPool;
+    }();
+    return *pool;
+}
+
+// Per-worker queue of ready nodes. The owner pushes and pops at the back, so it
+// keeps working depth-first on what it just made ready; idle workers steal
+// from the front, where the oldest and usually largest pieces of work are.
+struct WorkQueue
+{
+    std::mutex mutex;
+    std::deque<std::shared_ptr<Context>> items;
 
-    Value &operator+=(value_type &&rhs)
+    void push(std::shared_ptr<Context> ctx)
     {
-        return *this += rhs;
+        std::lock_guard<std::mutex> lock(mutex);
+        items.push_back(std::move(ctx));
     }
 
-    Value operator-()
+    std::shared_ptr<Context> pop()
     {
-        auto minus_1 = Value(-1);
-        return Value(ctx_ * minus_1.ctx_);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (items.empty())
+        {
+            return nullptr;
+        }
+        auto ctx = std::move(items.back());
+        items.pop_back();
+        return ctx;
     }
 
-    Value operator-(Value &rhs)
+    std::shared_ptr<Context> steal()
     {
-        auto n = -rhs;
-        return Value(ctx_ + n.ctx_);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (items.empty())
+        {
+            return nullptr;
+        }
+        auto ctx = std::move(items.front());
+        items.pop_front();
+        return ctx;
     }
+};
+
+// backward() on num_threads workers of backward_pool(). Dependency counts are
+// atomic and a node is queued by whichever consumer finishes last. Two nodes
+// that share an input may run at the same time, so a node's backward runs
+// holding the grad_guard of each of its inputs and its own backward_guard,
+// taken in address order. A worker with nothing to run or steal sleeps until
+// a node is queued or the walk is done.
+bool backward_parallel(const std::vector<std::shared_ptr<Context>> &roots, const std::vector<Context::value_type> &grads, size_t num_threads, bool retain_graph)
+{
+    std::unordered_map<Context *, uint32_t> index;
+    std::vector<Context *> nodes;
+    std::vector<uint32_t> counts;
 
-    Value operator-(Value &&rhs)
+    for (auto &root : roots)
+    {
+        if (!check_not_released(*root, "backward"))
+        {
+            return false;
+        }
+        if (index.try_emplace(root.get(), nodes.size()).second)
+        {
+            nodes.push_back(root.get());
+            counts.push_back(0);
+        }
+    }
+    for (size_t k = 0; k < nodes.size(); k++)
     {
-        return *this - rhs;
+        for (auto &child : nodes[k]->prev)
+        {
+            if (child->requires_grad)
+            {
+                if (!check_not_released(*child, "backward"))
+                {
+                    return false;
+                }
+                auto [it, inserted] = index.try_emplace(child.get(), nodes.size());
+                if (inserted)
+                {
+                    nodes.push_back(child.get());
+                    counts.push_back(0);
+                    if (!child->prev.empty())
+                    {
+                        child->grad = 0;
+                    }
+                }
+                counts[it->second]++;
+            }
+        }
     }
 
-    Value operator-(value_type rhs)
+    std::vector<std::atomic<uint32_t>> pending(nodes.size());
+    for (size_t k = 0; k < nodes.size(); k++)
     {
-        return *this - Value(rhs);
+        pending[k].store(counts[k], std::memory_order_relaxed);
     }
 
-    Value operator-(value_type &&rhs)
+    for (size_t i = 0; i < roots.size(); i++)
     {
-        return *this - rhs;
+        roots[i]->grad = grads[i];
     }
 
-    Value &operator-=(Value &rhs)
+    std::vector<WorkQueue> queues(num_threads);
+    std::atomic<size_t> remaining(nodes.size());
+    // Nodes in the queues, and workers asleep waiting for one
+    std::atomic<size_t> queued(0);
+    std::atomic<size_t> sleeping(0);
+    std::mutex idle_mutex;
+    std::condition_variable idle_cv;
+
+    // A sleeper counts itself before it checks queued and a pusher counts the
+    // node before it checks sleeping, so one of them sees the other
+    auto push = [&](size_t q, std::shared_ptr<Context> ctx)
     {
-        if (this != &rhs)
+        queues[q].push(std::move(ctx));
+        queued.fetch_add(1);
+        if (sleeping.load() > 0)
         {
-            auto out = *this - rhs;
-            ctx_ = out.ctx_;
+            {
+                std::lock_guard<std::mutex> lock(idle_mutex);
+            }
+            idle_cv.notify_one();
+        }
+    };
+
+    size_t next = 0;
+    for (auto &root : roots)
+    {
+        auto &p = pending[index[root.get()]];
+        if (p.load(std::memory_order_relaxed) == 0)
+        {
+            push(next++ % num_threads, root);
+            // Guards against the same root being queued twice
+            p.store(UINT32_MAX, std::memory_order_relaxed);
         }
-        return *this;
     }
 
-    Value &operator-=(Value &&rhs)
+    std::function<void(size_t)> worker = [&](size_t self)
     {
-        return *this -= rhs;
+        std::vector<std::atomic_flag *> locked;
+        while (remaining.load(std::memory_order_acquire) > 0)
+        {
+            auto ctx = queues[self].pop();
+            for (size_t k = 1; ctx == nullptr && k < num_threads; k++)
+            {
+                ctx = queues[(self + k) % num_threads].steal();
+            }
+            if (ctx == nullptr)
+            {
+                sleeping.fetch_add(1);
+                {
+                    std::unique_lock<std::mutex> lock(idle_mutex);
+                    idle_cv.wait(lock, [&]()
+                                 { return queued.load() > 0 || remaining.load() == 0; });
+                }
+                sleeping.fetch_sub(1);
+                continue;
+            }
+            queued.fetch_sub(1);
+
+            locked.clear();
+            for (auto &child : ctx->prev)
+            {
+                if (child->requires_grad)
+                {
+                    locked.push_back(child->grad_guard);
+                }
+            }
+            if (ctx->backward_guard != nullptr)
+            {
+                locked.push_back(ctx->backward_guard);
+            }
+            std::sort(locked.begin(), locked.end());
+            locked.erase(std::unique(locked.begin(), locked.end()), locked.end());
+            for (auto guard : locked)
+            {
+                while (guard->test_and_set(std::memory_order_acquire))
+                {
+                    guard->wait(true, std::memory_order_relaxed);
+                }
+            }
+
+            ctx->backward();
+
+            for (auto guard : locked)
+            {
+                guard->clear(std::memory_order_release);
+                guard->notify_one();
+            }
+
+            for (auto &child : ctx->prev)
+            {
+                if (child->requires_grad && pending[index.at(child.get())].fetch_sub(1, std::memory_order_acq_rel) == 1)
+                {
+                    push(self, retain_graph ? child : std::move(child));
+                }
+            }
+            if (!retain_graph)
+            {
+                ctx->release();
+            }
+            if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(idle_mutex);
+                }
+                idle_cv.notify_all();
+            }
+        }
+    };
+
+    backward_pool().run(num_threads, worker);
+    return true;
+}
+
+// Backpropagates from several roots at once, seeding each root's grad with the
+// matching entry of grads. A node's backward only runs once every node that
+// consumes it has run, so its grad is complete by the time it is propagated.
+// With num_threads > 1, independent nodes run in parallel.
+//
+// Unless retain_graph is set, each node is released as soon as it has
+// propagated, and intermediate nodes are freed once their last consumer has
+// run. Only the roots and the leaves are left, marked released if they are
+// not leaves. A later backward() that reaches one of them reports it and
+// returns false before it changes any leaf's grad.
+bool backward(const std::vector<std::shared_ptr<Context>> &roots, const std::vector<Context::value_type> &grads, size_t num_threads = 1, bool retain_graph = false)
+{
+    assert(roots.size() == grads.size());
+    evaluate_lazy();
+
+    if (num_threads > 1)
+    {
+        return backward_parallel(roots, grads, num_threads, retain_graph);
     }
 
-    Value &operator-=(value_type rhs)
+    // Number of consumers of each node that still have to run
+    std::unordered_map<Context *, size_t> pending;
+    std::vector<Context *> stack;
+
+    for (auto &root : roots)
+    {
+        if (!check_not_released(*root, "backward"))
+        {
+            return false;
+        }
+        if (pending.try_emplace(root.get(), 0).second)
+        {
+            stack.push_back(root.get());
+        }
+    }
+
+    while (!stack.empty())
     {
-        return *this -= Value(rhs);
+        auto ctx = stack.back();
+        stack.pop_back();
+
+        for (auto &child : ctx->prev)
+        {
+            if (child->requires_grad)
+            {
+                if (!check_not_released(*child, "backward"))
+                {
+                    return false;
+                }
+                auto [it, inserted] = pending.try_emplace(child.get(), 0);
+                it->second++;
+                if (inserted)
+                {
+                    stack.push_back(child.get());
+                    // Only leaves accumulate across calls, so a retained
+                    // graph can be walked again
+                    if (!child->prev.empty())
+                    {
+                        child->grad = 0;
+                    }
+                }
+            }
+        }
     }
 
-    Value &operator-=(value_type &&rhs)
+    // The queue owns what it holds: a released node may be its child's last
+    // owner
+    std::queue<std::shared_ptr<Context>> q;
+
+    for (size_t i = 0; i < roots.size(); i++)
     {
-        return *this -= rhs;
+        roots[i]->grad = grads[i];
     }
 
-    Value operator*(Value &rhs)
+    for (auto &root : roots)
     {
-        return Value(ctx_ * rhs.ctx_);
+        auto it = pending.find(root.get());
+        if (it->second == 0)
+        {
+            q.push(root);
+            // Guards against the same root being queued twice
+            it->second = SIZE_MAX;
+        }
+    }
+
+    while (q.size() > 0)
+    {
+        auto ctx = std::move(q.front());
+        q.pop();
+        ctx->backward();
+
+        for (auto &child : ctx->prev)
+        {
+            if (child->requires_grad && --pending[child.get()] == 0)
+            {
+                q.push(retain_graph ? child : std::move(child));
+            }
+        }
+        if (!retain_graph)
+        {
+            ctx->release();
+        }
+    }
+    return true;
+}
+
+bool backward(const std::shared_ptr<Context> &root, size_t num_threads = 1, bool retain_graph = false)
+{
+    return backward({root}, {1}, num_threads, retain_graph);
+}
+
+struct Value
+{
+    using value_type = Context::value_type;
+    std::shared_ptr<Context> ctx_;
+
+    Value(value_type data) : ctx_(new_context(data)) {}
+    Value(value_type data, const std::string &label) : ctx_(new_context(data, label)) {}
+    Value(std::shared_ptr<Context> &&ctx) : ctx_(std::move(ctx)) {}
+
+    // A value that never receives a gradient, e.g. a literal or a model input
+    static Value constant(value_type data)
+    {
+        auto out = Value(data);
+        out.ctx_->requires_grad = false;
+        return out;
+    }
+
+    // Operands are taken by const reference, or by value for floats, so
+    // temporaries bind without extra overloads and a float operand never
+    // converts to a Value. Results are built in place and moved out.
+
+    Value operator+(const Value &rhs) const
+    {
+        return Value(ctx_ + rhs.ctx_);
+    }
+
+    Value operator+(value_type rhs) const
+    {
+        return Value(ctx_ + rhs);
+    }
+
+    Value &operator+=(const Value &rhs)
+    {
+        if (this != &rhs)
+        {
+            ctx_ = ctx_ + rhs.ctx_;
+        }
+        return *this;
     }
 
-    Value operator*(Value &&rhs)
+    Value &operator+=(value_type rhs)
     {
-        return *this * rhs;
+        ctx_ = ctx_ + rhs;
+        return *this;
     }
 
-    Value operator*(value_type rhs)
+    Value operator-() const
     {
-        return *this * Value(rhs);
+        return Value(neg(ctx_));
     }
 
-    Value operator*(value_type &&rhs)
+    Value operator-(const Value &rhs) const
     {
-        return *this * rhs;
+        return Value(ctx_ - rhs.ctx_);
     }
 
-    Value &operator*=(Value &rhs)
+    Value operator-(value_type rhs) const
+    {
+        return Value(ctx_ + -rhs);
+    }
+
+    Value &operator-=(const Value &rhs)
     {
         if (this != &rhs)
         {
-            ctx_ = ctx_ * rhs.ctx_;
+            ctx_ = ctx_ - rhs.ctx_;
         }
         return *this;
     }
 
-    Value &operator*=(Value &&rhs)
+    Value &operator-=(value_type rhs)
     {
-        return *this *= rhs;
+        ctx_ = ctx_ + -rhs;
+        return *this;
     }
 
-    Value &operator*=(value_type rhs)
+    Value operator*(const Value &rhs) const
     {
-        return *this *= Value(rhs);
+        return Value(ctx_ * rhs.ctx_);
     }
 
-    Value &operator*=(value_type &&rhs)
+    Value operator*(value_type rhs) const
     {
-        return *this *= rhs;
+        return Value(ctx_ * rhs);
     }
 
-    Value operator/(Value &rhs)
+    Value &operator*=(const Value &rhs)
     {
-        Value n(-1);
-        auto b = rhs.pow(n);
-        return *this * b;
+        if (this != &rhs)
+        {
+            ctx_ = ctx_ * rhs.ctx_;
+        }
+        return *this;
     }
 
-    Value operator/(Value &&rhs)
+    Value &operator*=(value_type rhs)
     {
-        return *this / rhs;
+        ctx_ = ctx_ * rhs;
+        return *this;
     }
 
-    Value operator/(const value_type &rhs)
+    Value operator/(const Value &rhs) const
     {
-        return *this / Value(rhs);
+        return Value(ctx_ / rhs.ctx_);
     }
 
-    Value operator/(const value_type &&rhs)
+    Value operator/(value_type rhs) const
     {
-        return *this / rhs;
+        return Value(ctx_ * (1 / rhs));
     }
 
-    Value tanh()
+    Value tanh() const
     {
         return Value(::tanh(ctx_));
     }
 
-    Value exp()
+    Value exp() const
     {
         return Value(::exp(ctx_));
     }
 
-    Value pow(Value &lhs)
+    Value pow(const Value &rhs) const
+    {
+        return Value(::pow(ctx_, rhs.ctx_));
+    }
+
+    Value pow(value_type rhs) const
     {
-        return Value(::pow(ctx_, lhs.ctx_));
+        return Value(::pow(ctx_, rhs));
     }
 
-    Value pow(Value &&lhs)
+    Value square() const
     {
-        return pow(lhs);
+        return Value(::square(ctx_));
     }
 
-    Value pow(value_type lhs)
+    Value reciprocal() const
     {
-        return pow(Value(lhs));
+        return Value(::reciprocal(ctx_));
     }
 
-    Value pow(value_type &&lhs)
+    Value log() const
     {
-        return pow(Value(lhs));
+        return Value(::log(ctx_));
     }
 
-    void backward()
+    bool backward(size_t num_threads = 1, bool retain_graph = false) const
     {
-        return ::backward(ctx_);
+        return ::backward(ctx_, num_threads, retain_graph);
     }
 
     std::string repr() const
     {
         std::stringstream ss;
-        ss << "Value(data=" << ctx_->data << ")";
+        ss << "Value(data=" << data() << ")";
         return ss.str();
     }
 
     // Convenience methods to make updating context easy with similar api as original micrograd
+#ifdef MICROGRAD_LAZY
+    // Reading a lazily recorded node evaluates the ops recorded so far
+    value_type &data()
+    {
+        if (ctx_->lazy_depth != 0)
+        {
+            evaluate_lazy();
+        }
+        return ctx_->data;
+    }
+    const value_type &data() const
+    {
+        if (ctx_->lazy_depth != 0)
+        {
+            evaluate_lazy();
+        }
+        return ctx_->data;
+    }
+#else
     value_type &data() { return ctx_->data; }
     const value_type &data() const { return ctx_->data; }
+#endif
     value_type &grad() { return ctx_->grad; }
     const value_type &grad() const { return ctx_->grad; }
     std::string &label() { return ctx_->label; }
     const std::string &label() const { return ctx_->label; }
     std::string &op() { return ctx_->op; }
     const std::string &op() const { return ctx_->op; }
+    bool &requires_grad() { return ctx_->requires_grad; }
+    const bool &requires_grad() const { return ctx_->requires_grad; }
 };
 
-Value dot(std::vector<Value> &a, std::vector<Value> &b)
+bool backward(const std::vector<Value> &roots, const std::vector<Value::value_type> &grads, size_t num_threads = 1, bool retain_graph = false)
+{
+    std::vector<std::shared_ptr<Context>> ctxs;
+    ctxs.reserve(roots.size());
+    for (auto &r : roots)
+    {
+        ctxs.push_back(r.ctx_);
+    }
+    return backward(ctxs, grads, num_threads, retain_graph);
+}
+
+Value dot(const std::vector<Value> &a, const std::vector<Value> &b)
 {
     assert(a.size() == b.size());
-    auto out = Value(0, "zero");
+    auto out = Value::constant(0);
+    out.label() = "zero";
 
     for (size_t i = 0; i < a.size(); i++)
     {
@@ -352,13 +1326,13 @@ std::vector<Value> to_values(const std::vector<T> &values)
     out.reserve(values.size());
     for (auto &v : values)
     {
-        out.emplace_back(Value(static_cast<float>(v)));
+        out.emplace_back(Value::constant(static_cast<float>(v)));
     }
     return out;
 }
 
 template <typename T>
-std::string join(std::string sep, std::vector<T> &vec)
+std::string join(const std::string &sep, const std::vector<T> &vec)
 {
     std::stringstream ss;
     for (size_t i = 0; i < vec.size(); i++)
@@ -378,7 +1352,7 @@ std::ostream &operator<<(std::ostream &out, const Value &v)
     return out;
 };
 
-std::ostream &operator<<(std::ostream &out, std::vector<Value> &values)
+std::ostream &operator<<(std::ostream &out, const std::vector<Value> &values)
 {
     out << "[";
     for (size_t i = 0; i < values.size(); i++)
@@ -393,7 +1367,7 @@ std::ostream &operator<<(std::ostream &out, std::vector<Value> &values)
     return out;
 }
 
-std::ostream &operator<<(std::ostream &out, std::vector<std::vector<Value>> &values)
+std::ostream &operator<<(std::ostream &out, const std::vector<std::vector<Value>> &values)
 {
     bool print_space = false;
     out << "[";
@@ -0,0 +1,309 @@
+#pragma once
+#include <cmath>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include <micrograd/engine.hpp>
+
+// Expression templates for scalar Values. Start an expression with expr() and
+// write it as usual; the result is a tree of small value types rather than a
+// chain of graph nodes:
+//
+//     Value y = (expr(a) * b + c).tanh();
+//
+// Converting the tree to a Value (or calling fuse()) evaluates it in one pass
+// and adds a single "fused" node over its leaves. The node's backward walks
+// the same tree, generated per expression type at compile time, using the
+// intermediate values kept from the forward.
+//
+// An expression refers to the Values it was built from, so turn it into a
+// Value before they go out of scope: `auto e = expr(a) * b` is an expression,
+// not a Value.
+
+template <typename E>
+Value fuse(const E &expr);
+
+template <typename Op, typename A>
+struct UnaryExpr;
+
+struct NegOp;
+struct TanhOp;
+struct ExpOp;
+struct SquareOp;
+struct ReciprocalOp;
+struct PowOp;
+
+// Base of every expression node, for the unary ops and the conversion to Value
+template <typename E>
+struct Expr
+{
+    const E &self() const { return static_cast<const E &>(*this); }
+
+    auto tanh() const { return UnaryExpr<TanhOp, E>(self()); }
+    auto exp() const { return UnaryExpr<ExpOp, E>(self()); }
+    auto square() const { return UnaryExpr<SquareOp, E>(self()); }
+    auto reciprocal() const { return UnaryExpr<ReciprocalOp, E>(self()); }
+    auto pow(float p) const { return UnaryExpr<PowOp, E>(self(), p); }
+    auto operator-() const { return UnaryExpr<NegOp, E>(self()); }
+
+    operator Value() const { return fuse(self()); }
+};
+
+template <typename T>
+concept IsExpr = std::is_base_of_v<Expr<std::remove_cvref_t<T>>, std::remove_cvref_t<T>>;
+
+// A Value read by the expression
+struct LeafExpr : Expr<LeafExpr>
+{
+    const std::shared_ptr<Context> *owner;
+    Context *ctx;
+    float v = 0;
+
+    LeafExpr(const Value &value) : owner(&value.ctx_), ctx(value.ctx_.get()) {}
+
+    float forward()
+    {
+        v = ctx->data;
+        return v;
+    }
+
+    void backward(float g) const
+    {
+        if (ctx->requires_grad)
+        {
+            ctx->grad += g;
+        }
+    }
+
+    void leaves(std::vector<std::shared_ptr<Context>> &out) const { out.push_back(*owner); }
+};
+
+struct ScalarExpr : Expr<ScalarExpr>
+{
+    float v;
+
+    ScalarExpr(float v) : v(v) {}
+
+    float forward() { return v; }
+    void backward(float) const {}
+    void leaves(std::vector<std::shared_ptr<Context>> &) const {}
+};
+
+template <typename Op, typename L, typename R>
+struct BinaryExpr : Expr<BinaryExpr<Op, L, R>>
+{
+    L l;
+    R r;
+    float v = 0;
+
+    BinaryExpr(const L &l, const R &r) : l(l), r(r) {}
+
+    float forward()
+    {
+        v = Op::forward(l.forward(), r.forward());
+        return v;
+    }
+
+    void backward(float g) const { Op::backward(l, r, v, g); }
+
+    void leaves(std::vector<std::shared_ptr<Context>> &out) const
+    {
+        l.leaves(out);
+        r.leaves(out);
+    }
+};
+
+template <typename Op, typename A>
+struct UnaryExpr : Expr<UnaryExpr<Op, A>>
+{
+    A a;
+    // Exponent of pow
+    float p;
+    float v = 0;
+
+    UnaryExpr(const A &a, float p = 0) : a(a), p(p) {}
+
+    float forward()
+    {
+        v = Op::forward(a.forward(), p);
+        return v;
+    }
+
+    void backward(float g) const { Op::backward(a, p, v, g); }
+
+    void leaves(std::vector<std::shared_ptr<Context>> &out) const { a.leaves(out); }
+};
+
+// Each op's forward and its local derivative. v is the op's output, l.v, r.v
+// and a.v its inputs, all kept from the forward.
+
+struct AddOp
+{
+    static float forward(float a, float b) { return a + b; }
+    template <typename L, typename R>
+    static void backward(const L &l, const R &r, float, float g)
+    {
+        l.backward(g);
+        r.backward(g);
+    }
+};
+
+struct SubOp
+{
+    static float forward(float a, float b) { return a - b; }
+    template <typename L, typename R>
+    static void backward(const L &l, const R &r, float, float g)
+    {
+        l.backward(g);
+        r.backward(-g);
+    }
+};
+
+struct MulOp
+{
+    static float forward(float a, float b) { return a * b; }
+    template <typename L, typename R>
+    static void backward(const L &l, const R &r, float, float g)
+    {
+        l.backward(r.v * g);
+        r.backward(l.v * g);
+    }
+};
+
+struct DivOp
+{
+    static float forward(float a, float b) { return a / b; }
+    template <typename L, typename R>
+    static void backward(const L &l, const R &r, float v, float g)
+    {
+        l.backward(g / r.v);
+        r.backward(-v / r.v * g);
+    }
+};
+
+struct NegOp
+{
+    static float forward(float a, float) { return -a; }
+    template <typename A>
+    static void backward(const A &a, float, float, float g) { a.backward(-g); }
+};
+
+struct TanhOp
+{
+    static float forward(float a, float) { return approx_tanh(a, math_mode()); }
+    template <typename A>
+    static void backward(const A &a, float, float v, float g) { a.backward((1 - v * v) * g); }
+};
+
+struct ExpOp
+{
+    static float forward(float a, float) { return approx_exp(a, math_mode()); }
+    template <typename A>
+    static void backward(const A &a, float, float v, float g) { a.backward(v * g); }
+};
+
+struct SquareOp
+{
+    static float forward(float a, float) { return a * a; }
+    template <typename A>
+    static void backward(const A &a, float, float, float g) { a.backward(2 * a.v * g); }
+};
+
+struct ReciprocalOp
+{
+    static float forward(float a, float) { return 1 / a; }
+    template <typename A>
+    static void backward(const A &a, float, float v, float g) { a.backward(-v * v * g); }
+};
+
+struct PowOp
+{
+    static float forward(float a, float p) { return approx_pow(a, p, math_mode()); }
+    template <typename A>
+    static void backward(const A &a, float p, float, float g) { a.backward(p * approx_pow(a.v, p - 1, math_mode()) * g); }
+};
+
+inline LeafExpr expr(const Value &value)
+{
+    return LeafExpr(value);
+}
+
+// Expressions, Values and floats as expression operands
+template <typename T>
+auto as_expr(const T &x)
+{
+    if constexpr (IsExpr<T>)
+    {
+        return x;
+    }
+    else if constexpr (std::is_same_v<T, Value>)
+    {
+        return LeafExpr(x);
+    }
+    else
+    {
+        return ScalarExpr(static_cast<float>(x));
+    }
+}
+
+template <typename T>
+using expr_t = decltype(as_expr(std::declval<const T &>()));
+
+template <typename L, typename R>
+    requires(IsExpr<L> || IsExpr<R>)
+auto operator+(const L &l, const R &r)
+{
+    return BinaryExpr<AddOp, expr_t<L>, expr_t<R>>(as_expr(l), as_expr(r));
+}
+
+template <typename L, typename R>
+    requires(IsExpr<L> || IsExpr<R>)
+auto operator-(const L &l, const R &r)
+{
+    return BinaryExpr<SubOp, expr_t<L>, expr_t<R>>(as_expr(l), as_expr(r));
+}
+
+template <typename L, typename R>
+    requires(IsExpr<L> || IsExpr<R>)
+auto operator*(const L &l, const R &r)
+{
+    return BinaryExpr<MulOp, expr_t<L>, expr_t<R>>(as_expr(l), as_expr(r));
+}
+
+template <typename L, typename R>
+    requires(IsExpr<L> || IsExpr<R>)
+auto operator/(const L &l, const R &r)
+{
+    return BinaryExpr<DivOp, expr_t<L>, expr_t<R>>(as_expr(l), as_expr(r));
+}
+
+// Evaluates expr and adds it to the graph as one node over its leaves. A leaf
+// used twice appears twice in prev, as it would with separate ops.
+template <typename E>
+Value fuse(const E &expr)
+{
+    // The leaves are read directly
+    evaluate_lazy();
+    E e = expr;
+    float data = e.forward();
+
+    std::vector<std::shared_ptr<Context>> prev;
+    e.leaves(prev);
+    bool requires_grad = false;
+    for (auto &p : prev)
+    {
+        requires_grad |= p->requires_grad;
+    }
+    if (!requires_grad)
+    {
+        return Value::constant(data);
+    }
+
+    auto out = new_context(data, std::move(prev), "fused");
+    out->backward = [out = out.get(), e]()
+    {
+        e.backward(out->grad);
+    };
+    return Value(std::move(out));
+}
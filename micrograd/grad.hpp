@@ -0,0 +1,628 @@
+#pragma once
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <micrograd/engine.hpp>
+#include <micrograd/nn.hpp>
+
+// Gradients as Values. backward() accumulates plain floats into grad; grad()
+// instead builds the gradient out of ops on the original graph's nodes, so it
+// can be differentiated again:
+//
+//     std::vector<Value> g;
+//     grad(loss, params, g);     // dloss/dparams, as a graph
+//     grad(g[0], params, h);     // row 0 of the Hessian
+//
+// The graph must not have been released by a backward() without retain_graph;
+// grad() and jvp() return false if it was.
+
+// State of a "layer_t" node, W^T gz for the inputs of a "layer" node that need
+// a gradient. It is fed by gz and has one output per such input, as a Layer has
+// one per row; column is the input each output is for.
+struct LayerTranspose
+{
+    std::shared_ptr<ParameterBlock> block;
+    std::vector<char> trainable;
+    std::vector<uint32_t> columns;
+    // dL/d(output), filled in by the outputs' backward
+    std::vector<float> dy;
+};
+
+// The products with W of a layer's backward as one node, rather than a dot
+// product per input over rows Values each. Its backward does both products
+// of the whole matrix at once: W dy into gz, and gz dy^T into the weight
+// gradients of the trainable rows.
+std::vector<Value> layer_transpose(const Layer::Activation &act, const std::vector<Value> &gz, const std::vector<uint32_t> &columns)
+{
+    auto &block = *act.block;
+    auto lt = std::make_shared<LayerTranspose>();
+    lt->block = act.block;
+    lt->trainable = act.trainable;
+    lt->columns = columns;
+
+    std::vector<float> z(block.rows);
+    bool needs_graph = false;
+    for (size_t j = 0; j < block.rows; j++)
+    {
+        z[j] = gz[j].data();
+        needs_graph |= gz[j].requires_grad() || act.trainable[j];
+    }
+    std::vector<float> y(columns.size(), 0.0f);
+    for (size_t j = 0; j < block.rows; j++)
+    {
+        const float *wj = block.weight.data() + j * block.ld;
+        for (size_t k = 0; k < columns.size(); k++)
+        {
+            y[k] += wj[columns[k]] * z[j];
+        }
+    }
+
+    std::vector<Value> out;
+    out.reserve(columns.size());
+    if (!needs_graph)
+    {
+        for (auto v : y)
+        {
+            out.push_back(Value::constant(v));
+        }
+        return out;
+    }
+
+    std::vector<std::shared_ptr<Context>> prev;
+    prev.reserve(block.rows);
+    for (auto &g : gz)
+    {
+        prev.push_back(g.ctx_);
+    }
+    auto node = new_context(0, std::move(prev), "layer_t");
+    lt->dy.assign(columns.size(), 0);
+    node->attrs = lt;
+    node->backward_guard = &block.grad_lock;
+    node->backward = [node = node.get(), lt = lt.get()]()
+    {
+        auto &block = *lt->block;
+        for (size_t j = 0; j < block.rows; j++)
+        {
+            auto &g = *node->prev[j];
+            const float *wj = block.weight.data() + j * block.ld;
+            if (g.requires_grad)
+            {
+                float sum = 0;
+                for (size_t k = 0; k < lt->columns.size(); k++)
+                {
+                    sum += wj[lt->columns[k]] * lt->dy[k];
+                }
+                g.grad += sum;
+            }
+            if (lt->trainable[j])
+            {
+                float *gj = block.weight_grad.data() + j * block.ld;
+                for (size_t k = 0; k < lt->columns.size(); k++)
+                {
+                    gj[lt->columns[k]] += g.data * lt->dy[k];
+                }
+            }
+        }
+        std::fill(lt->dy.begin(), lt->dy.end(), 0.0f);
+    };
+
+    for (size_t k = 0; k < columns.size(); k++)
+    {
+        auto o = new_context(y[k], std::initializer_list<std::shared_ptr<Context>>{node}, "+");
+        o->index = k;
+        o->backward = [o = o.get(), lt]()
+        {
+            lt->dy[o->index] += o->grad;
+        };
+        out.push_back(Value(std::move(o)));
+    }
+    return out;
+}
+
+// Walks the graph behind output in reverse topological order and sets grads[k]
+// to d(output)/d(wrt[k]), a constant 0 if output does not depend on it.
+// Returns false and leaves grads untouched if it meets an op it has no
+// derivative for.
+bool grad(const Value &output, const std::vector<Value> &wrt, std::vector<Value> &grads)
+{
+    evaluate_lazy();
+
+    std::unordered_set<Context *> wanted;
+    for (auto &w : wrt)
+    {
+        wanted.insert(w.ctx_.get());
+    }
+
+    // Post-order DFS over the nodes that need a gradient
+    std::vector<std::shared_ptr<Context>> order;
+    std::unordered_set<Context *> visited;
+    std::vector<std::pair<std::shared_ptr<Context>, size_t>> stack;
+    if (output.ctx_->requires_grad)
+    {
+        visited.insert(output.ctx_.get());
+        stack.push_back({output.ctx_, 0});
+    }
+    while (!stack.empty())
+    {
+        auto &[ctx, next] = stack.back();
+        if (next < ctx->prev.size())
+        {
+            auto &child = ctx->prev[next++];
+            if (child->requires_grad && visited.insert(child.get()).second)
+            {
+                stack.push_back({child, 0});
+            }
+            continue;
+        }
+        order.push_back(std::move(ctx));
+        stack.pop_back();
+    }
+    for (auto &ctx : order)
+    {
+        if (!check_not_released(*ctx, "grad"))
+        {
+            return false;
+        }
+    }
+
+    // Adjoints of nodes, and of each output of a "layer" or "layer_t" node
+    std::unordered_map<Context *, Value> adjoint;
+    std::unordered_map<Context *, std::vector<Value>> layer_adjoint;
+    auto accumulate = [&](Context *ctx, const Value &g)
+    {
+        auto [it, inserted] = adjoint.try_emplace(ctx, g);
+        if (!inserted)
+        {
+            it->second = it->second + g;
+        }
+    };
+    adjoint.try_emplace(output.ctx_.get(), Value::constant(1));
+
+    for (auto it = order.rbegin(); it != order.rend(); it++)
+    {
+        auto &ctx = *it;
+        const std::string &op = ctx->op;
+
+        if (ctx->prev.empty())
+        {
+            continue;
+        }
+
+        if (op == "layer")
+        {
+            auto found = layer_adjoint.find(ctx.get());
+            if (found == layer_adjoint.end())
+            {
+                continue;
+            }
+            auto &gz = found->second;
+            auto act = std::static_pointer_cast<Layer::Activation>(ctx->attrs);
+            auto &block = *act->block;
+
+            std::vector<uint32_t> columns;
+            for (size_t i = 0; i < block.cols; i++)
+            {
+                if (ctx->prev[i]->requires_grad)
+                {
+                    columns.push_back(i);
+                }
+            }
+            if (!columns.empty())
+            {
+                auto dx = layer_transpose(*act, gz, columns);
+                for (size_t k = 0; k < columns.size(); k++)
+                {
+                    accumulate(ctx->prev[columns[k]].get(), dx[k]);
+                }
+            }
+            for (size_t j = 0; j < block.rows; j++)
+            {
+                if (!act->trainable[j])
+                {
+                    continue;
+                }
+                for (size_t i = 0; i <= block.cols; i++)
+                {
+                    auto p = block.param(j, i);
+                    if (wanted.contains(p.ctx_.get()))
+                    {
+                        accumulate(p.ctx_.get(), i < block.cols ? gz[j] * Value(std::shared_ptr<Context>(ctx->prev[i])) : gz[j]);
+                    }
+                }
+            }
+            continue;
+        }
+
+        // y_k = sum_j W[j][c_k] gz_j, one product per entry of W
+        if (op == "layer_t")
+        {
+            auto found = layer_adjoint.find(ctx.get());
+            if (found == layer_adjoint.end())
+            {
+                continue;
+            }
+            auto &gy = found->second;
+            auto lt = std::static_pointer_cast<LayerTranspose>(ctx->attrs);
+            auto &block = *lt->block;
+            for (size_t j = 0; j < block.rows; j++)
+            {
+                auto &gz = ctx->prev[j];
+                if (gz->requires_grad)
+                {
+                    Value d = Value::constant(0);
+                    for (size_t k = 0; k < lt->columns.size(); k++)
+                    {
+                        d += block.param(j, lt->columns[k]) * gy[k];
+                    }
+                    accumulate(gz.get(), d);
+                }
+                if (!lt->trainable[j])
+                {
+                    continue;
+                }
+                for (size_t k = 0; k < lt->columns.size(); k++)
+                {
+                    auto p = block.param(j, lt->columns[k]);
+                    if (wanted.contains(p.ctx_.get()))
+                    {
+                        accumulate(p.ctx_.get(), gy[k] * Value(std::shared_ptr<Context>(gz)));
+                    }
+                }
+            }
+            continue;
+        }
+
+        auto found = adjoint.find(ctx.get());
+        if (found == adjoint.end())
+        {
+            continue;
+        }
+        Value g = found->second;
+        Value o = Value(std::shared_ptr<Context>(ctx));
+        Value a = Value(std::shared_ptr<Context>(ctx->prev[0]));
+        Context *ca = ctx->prev[0].get();
+        auto add_a = [&](const Value &v)
+        {
+            if (ca->requires_grad)
+            {
+                accumulate(ca, v);
+            }
+        };
+
+        if (ctx->prev.size() == 1 && ca->op == "layer_t")
+        {
+            auto &gy = layer_adjoint[ca];
+            if (gy.empty())
+            {
+                gy.assign(std::static_pointer_cast<LayerTranspose>(ca->attrs)->columns.size(), Value::constant(0));
+            }
+            gy[ctx->index] += g;
+            continue;
+        }
+
+        if (ctx->prev.size() == 1 && ca->op == "layer")
+        {
+            auto &gz = layer_adjoint[ca];
+            if (gz.empty())
+            {
+                gz.assign(std::static_pointer_cast<Layer::Activation>(ca->attrs)->block->rows, Value::constant(0));
+            }
+            gz[ctx->index] += op == "tanh" ? g - g * o.square() : g;
+            continue;
+        }
+
+        if (ctx->prev.size() == 2)
+        {
+            Value b = Value(std::shared_ptr<Context>(ctx->prev[1]));
+            Context *cb = ctx->prev[1].get();
+            auto add_b = [&](const Value &v)
+            {
+                if (cb->requires_grad)
+                {
+                    accumulate(cb, v);
+                }
+            };
+
+            if (op == "+")
+            {
+                add_a(g);
+                add_b(g);
+            }
+            else if (op == "-")
+            {
+                add_a(g);
+                add_b(-g);
+            }
+            else if (op == "*")
+            {
+                add_a(g * b);
+                add_b(g * a);
+            }
+            else if (op == "/")
+            {
+                add_a(g / b);
+                add_b(-(g * o / b));
+            }
+            else if (op == "pow")
+            {
+                add_a(g * b * a.pow(b - 1.0f));
+                // As in backward(), a base <= 0 gives the exponent nothing
+                if (cb->requires_grad && a.data() > 0)
+                {
+                    add_b(g * o * a.log());
+                }
+            }
+            else
+            {
+                std::cerr << "grad: no derivative for op '" << op << "'" << std::endl;
+                return false;
+            }
+            continue;
+        }
+
+        if (op == "tanh")
+        {
+            add_a(g - g * o.square());
+        }
+        else if (op == "exp")
+        {
+            add_a(g * o);
+        }
+        else if (op == "neg")
+        {
+            add_a(-g);
+        }
+        else if (op == "square")
+        {
+            add_a(g * a * 2.0f);
+        }
+        else if (op == "reciprocal")
+        {
+            add_a(-(g * o.square()));
+        }
+        else if (op == "log")
+        {
+            add_a(g / a);
+        }
+        else if (op == "+c")
+        {
+            add_a(g);
+        }
+        else if (op == "*c")
+        {
+            add_a(g * ctx->scalar);
+        }
+        else if (op == "^c")
+        {
+            add_a(g * a.pow(ctx->scalar - 1) * ctx->scalar);
+        }
+        else
+        {
+            std::cerr << "grad: no derivative for op '" << op << "'" << std::endl;
+            return false;
+        }
+    }
+
+    grads.clear();
+    grads.reserve(wrt.size());
+    for (auto &w : wrt)
+    {
+        auto found = adjoint.find(w.ctx_.get());
+        grads.push_back(found != adjoint.end() ? found->second : Value::constant(0));
+    }
+    return true;
+}
+
+// Forward-mode derivative of outputs along v: out[k] is the sum over i of
+// d(outputs[k])/d(wrt[i]) * v[i]. One sweep over the graph in topological
+// order, carrying a tangent per node, without building anything.
+bool jvp(const std::vector<Value> &outputs, const std::vector<Value> &wrt, const std::vector<float> &v, std::vector<float> &out)
+{
+    assert(wrt.size() == v.size());
+    evaluate_lazy();
+
+    std::unordered_map<Context *, float> tangent;
+    for (size_t i = 0; i < wrt.size(); i++)
+    {
+        tangent[wrt[i].ctx_.get()] += v[i];
+    }
+    auto tangent_of = [&](Context *ctx)
+    {
+        auto found = tangent.find(ctx);
+        return found != tangent.end() ? found->second : 0.0f;
+    };
+
+    // Post-order DFS, so every node comes after the nodes it reads
+    std::vector<Context *> order;
+    std::unordered_set<Context *> visited;
+    std::vector<std::pair<Context *, size_t>> stack;
+    for (auto &output : outputs)
+    {
+        if (!output.ctx_->requires_grad || !visited.insert(output.ctx_.get()).second)
+        {
+            continue;
+        }
+        stack.push_back({output.ctx_.get(), 0});
+        while (!stack.empty())
+        {
+            auto &[ctx, next] = stack.back();
+            if (next < ctx->prev.size())
+            {
+                auto child = ctx->prev[next++].get();
+                if (child->requires_grad && visited.insert(child).second)
+                {
+                    stack.push_back({child, 0});
+                }
+                continue;
+            }
+            order.push_back(ctx);
+            stack.pop_back();
+        }
+    }
+    for (auto ctx : order)
+    {
+        if (!check_not_released(*ctx, "jvp"))
+        {
+            return false;
+        }
+    }
+
+    // Tangents of the W x + b of each "layer" node, and of the outputs of each
+    // "layer_t" node
+    std::unordered_map<Context *, std::vector<float>> layer_tangent;
+
+    for (auto ctx : order)
+    {
+        if (ctx->prev.empty())
+        {
+            continue;
+        }
+        const std::string &op = ctx->op;
+        Context *a = ctx->prev[0].get();
+        float o = ctx->data;
+        float ta = tangent_of(a);
+        float t;
+
+        if (op == "layer")
+        {
+            auto act = std::static_pointer_cast<Layer::Activation>(ctx->attrs);
+            auto &block = *act->block;
+            auto &tz = layer_tangent[ctx];
+            tz.assign(block.rows, 0.0f);
+            for (size_t j = 0; j < block.rows; j++)
+            {
+                for (size_t i = 0; i <= block.cols; i++)
+                {
+                    float x = i < block.cols ? ctx->prev[i]->data : 1.0f;
+                    float w = i < block.cols ? block.weight[j * block.ld + i] : 0.0f;
+                    float tx = i < block.cols ? tangent_of(ctx->prev[i].get()) : 0.0f;
+                    tz[j] += w * tx + tangent_of(&block.contexts[j * (block.cols + 1) + i]) * x;
+                }
+            }
+            continue;
+        }
+        else if (op == "layer_t")
+        {
+            // The same rule for W^T gz: W^T t(gz) + t(W)^T gz
+            auto lt = std::static_pointer_cast<LayerTranspose>(ctx->attrs);
+            auto &block = *lt->block;
+            auto &ty = layer_tangent[ctx];
+            ty.assign(lt->columns.size(), 0.0f);
+            for (size_t j = 0; j < block.rows; j++)
+            {
+                float gz = ctx->prev[j]->data;
+                float tgz = tangent_of(ctx->prev[j].get());
+                for (size_t k = 0; k < lt->columns.size(); k++)
+                {
+                    size_t i = lt->columns[k];
+                    ty[k] += block.weight[j * block.ld + i] * tgz + tangent_of(&block.contexts[j * (block.cols + 1) + i]) * gz;
+                }
+            }
+            continue;
+        }
+        else if (ctx->prev.size() == 1 && a->op == "layer_t")
+        {
+            t = layer_tangent[a][ctx->index];
+        }
+        else if (ctx->prev.size() == 1 && a->op == "layer")
+        {
+            float tz = layer_tangent[a][ctx->index];
+            t = op == "tanh" ? (1 - o * o) * tz : tz;
+        }
+        else if (ctx->prev.size() == 2)
+        {
+            Context *b = ctx->prev[1].get();
+            float tb = tangent_of(b);
+            if (op == "+")
+            {
+                t = ta + tb;
+            }
+            else if (op == "-")
+            {
+                t = ta - tb;
+            }
+            else if (op == "*")
+            {
+                t = ta * b->data + a->data * tb;
+            }
+            else if (op == "/")
+            {
+                t = (ta - o * tb) / b->data;
+            }
+            else if (op == "pow")
+            {
+                t = b->data * approx_pow(a->data, b->data - 1, math_mode()) * ta;
+                if (a->data > 0)
+                {
+                    t += o * approx_log(a->data, math_mode()) * tb;
+                }
+            }
+            else
+            {
+                std::cerr << "jvp: no derivative for op '" << op << "'" << std::endl;
+                return false;
+            }
+        }
+        else if (op == "tanh")
+        {
+            t = (1 - o * o) * ta;
+        }
+        else if (op == "exp")
+        {
+            t = o * ta;
+        }
+        else if (op == "neg")
+        {
+            t = -ta;
+        }
+        else if (op == "square")
+        {
+            t = 2 * a->data * ta;
+        }
+        else if (op == "reciprocal")
+        {
+            t = -o * o * ta;
+        }
+        else if (op == "log")
+        {
+            t = ta / a->data;
+        }
+        else if (op == "+c")
+        {
+            t = ta;
+        }
+        else if (op == "*c")
+        {
+            t = ctx->scalar * ta;
+        }
+        else if (op == "^c")
+        {
+            t = ctx->scalar * approx_pow(a->data, ctx->scalar - 1, math_mode()) * ta;
+        }
+        else
+        {
+            std::cerr << "jvp: no derivative for op '" << op << "'" << std::endl;
+            return false;
+        }
+        tangent[ctx] = t;
+    }
+
+    out.clear();
+    out.reserve(outputs.size());
+    for (auto &output : outputs)
+    {
+        out.push_back(tangent_of(output.ctx_.get()));
+    }
+    return true;
+}
+
+// Hessian-vector product: hv = H v, where H is the Hessian of output with
+// respect to params. Forward-over-reverse: grad() builds the gradient as a
+// graph and jvp() differentiates it along v, so H is never formed.
+bool hvp(const Value &output, const std::vector<Value> &params, const std::vector<float> &v, std::vector<float> &hv)
+{
+    std::vector<Value> g;
+    return grad(output, params, g) && jvp(g, params, v, hv);
+}
@@ -25,12 +25,13 @@ std::string context_to_graphviz(const std::shared_ptr<Context> &ctx)
     return ss.str();
 }
 
-auto trace(Value &root)
+auto trace(const Value &root)
 {
+    evaluate_lazy();
     std::unordered_set<std::shared_ptr<Context>> nodes;
     std::vector<std::pair<std::shared_ptr<Context>, std::shared_ptr<Context>>> edges;
 
-    std::function<void(std::shared_ptr<Context>&)> build = [&](std::shared_ptr<Context> &node)
+    std::function<void(const std::shared_ptr<Context> &)> build = [&](const std::shared_ptr<Context> &node)
     {
         if (!nodes.contains(node))
         {
@@ -47,7 +48,7 @@ auto trace(Value &root)
     return std::make_pair(nodes, edges);
 }
 
-void draw_dot(Value &root, const std::string &filename, const std::string &rankdir = "LR")
+void draw_dot(const Value &root, const std::string &filename, const std::string &rankdir = "LR")
 {
     if (rankdir != "LR" && rankdir != "TB")
     {
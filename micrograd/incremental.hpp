@@ -0,0 +1,374 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+#include <micrograd/engine.hpp>
+#include <micrograd/nn.hpp>
+
+// Recomputes the forward of an existing graph after some of its inputs or
+// parameters change, visiting only the nodes downstream of them instead of
+// building the whole graph again:
+//
+//     auto y = n(x);
+//     auto inc = Incremental(y);
+//     inc.set(x[3], 0.5f);                 // or change data(), then touch()
+//     inc.set(n.parameters()[7], 0.1f);
+//     inc.update();                        // y as if n(x) ran again
+//     inc.recomputed;                      // how many nodes that took
+//
+// Dirty flags spread from the touched nodes to their consumers in topological
+// order, so a node is recomputed at most once per update() and only after its
+// inputs. They stop at a node whose value comes out unchanged, e.g. a
+// saturated tanh.
+//
+// Only what the graph holds is tracked: an op whose inputs are all constants is
+// folded into a constant when built and does not follow them, and "fused" and
+// "gather" nodes can't be recomputed. A backward() without retain_graph
+// releases the graph, after which it can't be updated either: the constructor
+// reports it and update() returns false.
+struct Incremental
+{
+    using value_type = Context::value_type;
+    using Apply = value_type (*)(value_type, value_type);
+
+    static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+    enum class Kind : uint8_t
+    {
+        Leaf,
+        Op,
+        Layer,
+        LayerOutput,
+        Unsupported,
+    };
+
+    // A "layer" node's W x + b, kept to recompute its outputs and to find which
+    // of them changed
+    struct LayerState
+    {
+        uint32_t node;
+        std::shared_ptr<Layer::Activation> act;
+        std::vector<value_type> z;
+        // Position of each output, none if the outputs given don't use it
+        std::vector<uint32_t> outputs;
+        // Rows whose parameters changed, and whether the inputs did
+        std::vector<char> dirty_rows;
+        bool inputs_dirty = false;
+    };
+
+    // Nodes in topological order, inputs first, and what each one is
+    std::vector<std::shared_ptr<Context>> order;
+    std::vector<Kind> kinds;
+    std::vector<Apply> apply;
+    // For a layer node or a layer output, its index in layers
+    std::vector<uint32_t> slot;
+    std::unordered_map<const Context *, uint32_t> position;
+    // The consumers of node k are consumers[first_consumer[k]] up to
+    // consumers[first_consumer[k + 1]]
+    std::vector<uint32_t> first_consumer;
+    std::vector<uint32_t> consumers;
+    std::vector<LayerState> layers;
+
+    std::vector<char> dirty;
+    std::priority_queue<uint32_t, std::vector<uint32_t>, std::greater<uint32_t>> pending;
+    // Nodes recomputed by the last update()
+    size_t recomputed = 0;
+    // Whether the outputs reach a node released by backward()
+    bool released = false;
+
+    Incremental(const std::vector<Value> &outputs)
+    {
+        evaluate_lazy();
+
+        // Post-order DFS over everything the outputs read
+        std::vector<std::pair<std::shared_ptr<Context>, size_t>> stack;
+        for (auto &output : outputs)
+        {
+            if (!position.try_emplace(output.ctx_.get(), 0).second)
+            {
+                continue;
+            }
+            stack.push_back({output.ctx_, 0});
+            while (!stack.empty())
+            {
+                auto &[ctx, next] = stack.back();
+                if (next < ctx->prev.size())
+                {
+                    auto &child = ctx->prev[next++];
+                    if (position.try_emplace(child.get(), 0).second)
+                    {
+                        stack.push_back({child, 0});
+                    }
+                    continue;
+                }
+                position[ctx.get()] = order.size();
+                order.push_back(std::move(ctx));
+                stack.pop_back();
+            }
+        }
+
+        const size_t n = order.size();
+        kinds.resize(n);
+        apply.resize(n, nullptr);
+        slot.resize(n, none);
+        dirty.resize(n, 0);
+        first_consumer.assign(n + 1, 0);
+
+        for (size_t k = 0; k < n; k++)
+        {
+            auto &ctx = *order[k];
+            if (!released && !check_not_released(ctx, "Incremental"))
+            {
+                released = true;
+            }
+            if (ctx.prev.empty())
+            {
+                kinds[k] = Kind::Leaf;
+            }
+            else if (ctx.op == "layer")
+            {
+                kinds[k] = Kind::Layer;
+                slot[k] = layers.size();
+                add_layer(k);
+            }
+            else if (ctx.prev.size() == 1 && ctx.prev[0]->op == "layer")
+            {
+                kinds[k] = Kind::LayerOutput;
+                slot[k] = slot[position[ctx.prev[0].get()]];
+                layers[slot[k]].outputs[ctx.index] = k;
+            }
+            else
+            {
+                apply[k] = kernel(ctx.op);
+                kinds[k] = apply[k] != nullptr ? Kind::Op : Kind::Unsupported;
+            }
+
+            for (auto &p : ctx.prev)
+            {
+                first_consumer[position[p.get()] + 1]++;
+            }
+        }
+
+        for (size_t k = 0; k < n; k++)
+        {
+            first_consumer[k + 1] += first_consumer[k];
+        }
+        consumers.resize(first_consumer[n]);
+        std::vector<uint32_t> fill(first_consumer.begin(), first_consumer.end() - 1);
+        for (size_t k = 0; k < n; k++)
+        {
+            for (auto &p : order[k]->prev)
+            {
+                consumers[fill[position[p.get()]]++] = k;
+            }
+        }
+    }
+
+    // Marks v as changed, so that the next update() recomputes what reads it.
+    // v is a node of the graph or a parameter of a Layer in it. Returns false
+    // if it is neither.
+    bool touch(const Value &v)
+    {
+        const Context *ctx = v.ctx_.get();
+        bool found = false;
+
+        auto it = position.find(ctx);
+        if (it != position.end())
+        {
+            mark_consumers(it->second);
+            found = true;
+        }
+
+        // Parameters in a block are not in prev; the layer nodes read them
+        auto address = reinterpret_cast<uintptr_t>(ctx);
+        for (auto &layer : layers)
+        {
+            auto &block = *layer.act->block;
+            auto first = reinterpret_cast<uintptr_t>(block.contexts);
+            auto last = reinterpret_cast<uintptr_t>(block.contexts + block.rows * (block.cols + 1));
+            if (address >= first && address < last)
+            {
+                size_t j = (ctx - block.contexts) / (block.cols + 1);
+                layer.dirty_rows[j] = 1;
+                mark(layer.node);
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    // Sets v's data and touches it
+    bool set(const Value &v, value_type data)
+    {
+        v.ctx_->data = data;
+        return touch(v);
+    }
+
+    // Recomputes every node downstream of what was touched since the last
+    // update(). Returns false if it meets a node it can't recompute; the nodes
+    // after it keep their old data.
+    bool update()
+    {
+        recomputed = 0;
+        if (released)
+        {
+            clear();
+            return false;
+        }
+        while (!pending.empty())
+        {
+            uint32_t k = pending.top();
+            pending.pop();
+            dirty[k] = 0;
+            auto &ctx = *order[k];
+
+            if (kinds[k] == Kind::Unsupported)
+            {
+                std::cerr << "update: can't recompute op '" << ctx.op << "'" << std::endl;
+                clear();
+                return false;
+            }
+            recomputed++;
+
+            if (kinds[k] == Kind::Layer)
+            {
+                update_layer(layers[slot[k]]);
+                continue;
+            }
+
+            value_type data;
+            if (kinds[k] == Kind::LayerOutput)
+            {
+                value_type z = layers[slot[k]].z[ctx.index];
+                data = ctx.op == "tanh" ? approx_tanh(z, math_mode()) : z;
+            }
+            else
+            {
+                data = apply[k](ctx.prev[0]->data, ctx.prev.size() > 1 ? ctx.prev[1]->data : ctx.scalar);
+            }
+            if (data != ctx.data)
+            {
+                ctx.data = data;
+                mark_consumers(k);
+            }
+        }
+        return true;
+    }
+
+private:
+    // The forward of an op on one element, as in make_result()
+    static Apply kernel(const std::string &op)
+    {
+        static const std::unordered_map<std::string, Apply> kernels = {
+            {"+", AddKernel::apply},
+            {"+c", AddKernel::apply},
+            {"-", SubKernel::apply},
+            {"*", MulKernel::apply},
+            {"*c", MulKernel::apply},
+            {"/", DivKernel::apply},
+            {"pow", PowKernel::apply},
+            {"^c", PowKernel::apply},
+            {"tanh", TanhKernel::apply},
+            {"exp", ExpKernel::apply},
+            {"neg", NegKernel::apply},
+            {"square", SquareKernel::apply},
+            {"reciprocal", ReciprocalKernel::apply},
+            {"log", LogKernel::apply},
+        };
+        auto found = kernels.find(op);
+        return found != kernels.end() ? found->second : nullptr;
+    }
+
+    void add_layer(uint32_t k)
+    {
+        auto act = std::static_pointer_cast<Layer::Activation>(order[k]->attrs);
+        auto &block = *act->block;
+        LayerState state;
+        state.node = k;
+        state.act = act;
+        state.z.resize(block.rows);
+        block.gemv(act->x.data(), state.z.data());
+        state.outputs.assign(block.rows, none);
+        state.dirty_rows.assign(block.rows, 0);
+        layers.push_back(std::move(state));
+    }
+
+    void mark(uint32_t k)
+    {
+        if (!dirty[k])
+        {
+            dirty[k] = 1;
+            pending.push(k);
+        }
+    }
+
+    void mark_consumers(uint32_t k)
+    {
+        for (uint32_t c = first_consumer[k]; c < first_consumer[k + 1]; c++)
+        {
+            uint32_t consumer = consumers[c];
+            if (kinds[consumer] == Kind::Layer)
+            {
+                layers[slot[consumer]].inputs_dirty = true;
+            }
+            mark(consumer);
+        }
+    }
+
+    // Recomputes the rows of W x + b that changed: all of them after a change
+    // of x, else those of the touched parameters. Marks the outputs of the
+    // rows whose value did change.
+    void update_layer(LayerState &state)
+    {
+        auto &node = *order[state.node];
+        auto &act = *state.act;
+        auto &block = *act.block;
+
+        if (state.inputs_dirty)
+        {
+            // backward() reads x from here too
+            for (size_t i = 0; i < block.cols; i++)
+            {
+                act.x[i] = node.prev[i]->data;
+            }
+        }
+        for (size_t j = 0; j < block.rows; j++)
+        {
+            if (!state.inputs_dirty && !state.dirty_rows[j])
+            {
+                continue;
+            }
+            state.dirty_rows[j] = 0;
+            value_type z = block.bias[j] + ParameterBlock::dot(block.weight.data() + j * block.ld, act.x.data(), block.cols);
+            if (z != state.z[j])
+            {
+                state.z[j] = z;
+                if (state.outputs[j] != none)
+                {
+                    mark(state.outputs[j]);
+                }
+            }
+        }
+        state.inputs_dirty = false;
+    }
+
+    void clear()
+    {
+        while (!pending.empty())
+        {
+            dirty[pending.top()] = 0;
+            pending.pop();
+        }
+        for (auto &layer : layers)
+        {
+            std::fill(layer.dirty_rows.begin(), layer.dirty_rows.end(), 0);
+            layer.inputs_dirty = false;
+        }
+    }
+};
@@ -0,0 +1,268 @@
+#pragma once
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <micrograd/engine.hpp>
+#include <micrograd/nn.hpp>
+#include <micrograd/runtime.hpp>
+
+// A traced graph in the binary format read by IrProgram (see runtime.hpp).
+// params[k] is the Value behind parameter slot k, in the same order as the
+// parameter values in the file.
+struct IrGraph
+{
+    std::string bytes;
+    std::vector<Value> params;
+
+    bool save(const std::string &filename) const
+    {
+        std::ofstream file(filename, std::ios::binary);
+        if (!file.write(bytes.data(), bytes.size()))
+        {
+            std::cerr << "Failed to write " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+// Leaves for the inputs of a graph to trace. Unlike to_values() they require a
+// gradient, so the ops over them are recorded rather than folded into
+// constants that would not follow a new input.
+std::vector<Value> trace_inputs(const std::vector<float> &values)
+{
+    std::vector<Value> out;
+    out.reserve(values.size());
+    for (auto v : values)
+    {
+        out.emplace_back(v);
+    }
+    return out;
+}
+
+// Walks the graph behind outputs and lowers it to runtime instructions:
+//
+//   - inputs become Input slots, in the order given. They must come from
+//     trace_inputs(), as ops over constant inputs have already been folded
+//   - other leaves that require a gradient become parameter slots
+//   - leaves that do not are baked in as constants, frozen parameters included
+//   - a Layer's "layer" node becomes one Layer instruction over a parameter
+//     region holding its weights, and its outputs LayerOut instructions
+//
+// Returns false and leaves graph untouched if it meets an op the runtime
+// does not know or a node released by backward().
+bool trace_ir(const std::vector<Value> &outputs, const std::vector<Value> &inputs, IrGraph &graph)
+{
+    evaluate_lazy();
+    std::unordered_map<Context *, uint32_t> input_index;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (!inputs[i].ctx_->requires_grad)
+        {
+            std::cerr << "trace_ir: input " << i << " is a constant, so the ops over it were folded; "
+                      << "build the graph over trace_inputs()" << std::endl;
+            return false;
+        }
+        input_index.try_emplace(inputs[i].ctx_.get(), i);
+    }
+
+    // Post-order DFS, so every node comes after the nodes it reads
+    std::vector<std::shared_ptr<Context>> order;
+    std::unordered_map<Context *, uint32_t> position;
+    std::vector<std::pair<std::shared_ptr<Context>, size_t>> stack;
+    for (auto &out : outputs)
+    {
+        if (!position.try_emplace(out.ctx_.get(), UINT32_MAX).second)
+        {
+            continue;
+        }
+        stack.push_back({out.ctx_, 0});
+        while (!stack.empty())
+        {
+            auto &[ctx, next] = stack.back();
+            if (next < ctx->prev.size())
+            {
+                auto &child = ctx->prev[next++];
+                if (position.try_emplace(child.get(), UINT32_MAX).second)
+                {
+                    stack.push_back({child, 0});
+                }
+                continue;
+            }
+            position[ctx.get()] = order.size();
+            order.push_back(std::move(ctx));
+            stack.pop_back();
+        }
+    }
+
+    std::string code;
+    auto put = [](std::string &out, auto v)
+    {
+        out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    };
+
+    std::vector<Value> params;
+    std::vector<float> param_data;
+    std::unordered_map<Context *, uint32_t> param_slot;
+    std::unordered_map<ParameterBlock *, uint32_t> block_slot;
+
+    for (auto &ctx : order)
+    {
+        if (!check_not_released(*ctx, "trace_ir"))
+        {
+            return false;
+        }
+        const std::string &op = ctx->op;
+        auto operands = [&](IrOp op)
+        {
+            put(code, op);
+            for (auto &p : ctx->prev)
+            {
+                put(code, position[p.get()]);
+            }
+        };
+        bool from_layer = ctx->prev.size() == 1 && ctx->prev[0]->op == "layer";
+
+        if (ctx->prev.empty())
+        {
+            auto in = input_index.find(ctx.get());
+            if (in != input_index.end())
+            {
+                put(code, IrOp::Input);
+                put(code, in->second);
+            }
+            else if (ctx->requires_grad)
+            {
+                auto [it, inserted] = param_slot.try_emplace(ctx.get(), params.size());
+                if (inserted)
+                {
+                    params.push_back(Value(std::shared_ptr<Context>(ctx)));
+                    param_data.push_back(ctx->data);
+                }
+                put(code, IrOp::Param);
+                put(code, it->second);
+            }
+            else
+            {
+                put(code, IrOp::Const);
+                put(code, ctx->data);
+            }
+        }
+        else if (from_layer)
+        {
+            put(code, IrOp::LayerOut);
+            put(code, position[ctx->prev[0].get()]);
+            put(code, uint32_t(ctx->index));
+        }
+        else if (op == "+" && ctx->prev.size() == 2)
+        {
+            operands(IrOp::Add);
+        }
+        else if (op == "*" && ctx->prev.size() == 2)
+        {
+            operands(IrOp::Mul);
+        }
+        else if (op == "pow" && ctx->prev.size() == 2)
+        {
+            operands(IrOp::Pow);
+        }
+        else if (op == "tanh" && ctx->prev.size() == 1)
+        {
+            operands(IrOp::Tanh);
+        }
+        else if (op == "exp" && ctx->prev.size() == 1)
+        {
+            operands(IrOp::Exp);
+        }
+        else if (op == "-" && ctx->prev.size() == 2)
+        {
+            operands(IrOp::Sub);
+        }
+        else if (op == "/" && ctx->prev.size() == 2)
+        {
+            operands(IrOp::Div);
+        }
+        else if (op == "neg" && ctx->prev.size() == 1)
+        {
+            operands(IrOp::Neg);
+        }
+        else if (op == "square" && ctx->prev.size() == 1)
+        {
+            operands(IrOp::Square);
+        }
+        else if (op == "reciprocal" && ctx->prev.size() == 1)
+        {
+            operands(IrOp::Reciprocal);
+        }
+        else if ((op == "+c" || op == "*c" || op == "^c") && ctx->prev.size() == 1)
+        {
+            operands(op == "+c" ? IrOp::AddScalar : op == "*c" ? IrOp::MulScalar : IrOp::PowScalar);
+            put(code, ctx->scalar);
+        }
+        else if (op == "layer")
+        {
+            auto act = std::static_pointer_cast<Layer::Activation>(ctx->attrs);
+            auto &block = *act->block;
+            auto [it, inserted] = block_slot.try_emplace(&block, params.size());
+            if (inserted)
+            {
+                for (size_t j = 0; j < block.rows; j++)
+                {
+                    for (size_t i = 0; i < block.cols; i++)
+                    {
+                        params.push_back(block.param(j, i));
+                        param_data.push_back(block.weight[j * block.ld + i]);
+                    }
+                }
+                for (size_t j = 0; j < block.rows; j++)
+                {
+                    params.push_back(block.param(j, block.cols));
+                    param_data.push_back(block.bias[j]);
+                }
+            }
+            put(code, IrOp::Layer);
+            put(code, uint32_t(block.cols));
+            put(code, uint32_t(block.rows));
+            put(code, it->second);
+            for (auto nonlin : act->nonlin)
+            {
+                put(code, uint8_t(nonlin));
+            }
+            for (auto &p : ctx->prev)
+            {
+                put(code, position[p.get()]);
+            }
+        }
+        else
+        {
+            std::cerr << "trace_ir: unsupported op '" << op << "'" << std::endl;
+            return false;
+        }
+    }
+
+    std::string bytes("MGIR");
+    put(bytes, ir_version);
+    put(bytes, uint32_t(inputs.size()));
+    put(bytes, uint32_t(param_data.size()));
+    put(bytes, uint32_t(order.size()));
+    put(bytes, uint32_t(outputs.size()));
+    bytes.append(reinterpret_cast<const char *>(param_data.data()), param_data.size() * sizeof(float));
+    bytes += code;
+    for (auto &out : outputs)
+    {
+        put(bytes, position[out.ctx_.get()]);
+    }
+
+    graph.bytes = std::move(bytes);
+    graph.params = std::move(params);
+    return true;
+}
+
+bool export_ir(const std::vector<Value> &outputs, const std::vector<Value> &inputs, const std::string &filename)
+{
+    IrGraph graph;
+    return trace_ir(outputs, inputs, graph) && graph.save(filename);
+}
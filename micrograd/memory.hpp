@@ -0,0 +1,293 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <fstream>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Where the engine and the nn modules get their memory from. Graph nodes are
+// allocated from memory_resources().graph and weight matrices, embedding
+// tables and their gradients from memory_resources().weights. Both default to
+// nullptr, which is the global heap without the detour through a resource, and
+// can be replaced per thread:
+//
+//     auto huge = HugePageResource(HugePages::Transparent);
+//     auto pool = std::pmr::synchronized_pool_resource(&huge);
+//     ScopedMemoryResources scope({&pool, &pool});
+//     auto n = MLP(...);   // weights in 2MB pages
+//
+// Memory is freed through the resource it came from, so a resource must outlive
+// everything allocated from it.
+
+struct MemoryResources
+{
+    std::pmr::memory_resource *graph;
+    std::pmr::memory_resource *weights;
+};
+
+// The current thread's resources
+MemoryResources &memory_resources()
+{
+    thread_local MemoryResources resources = {nullptr, nullptr};
+    return resources;
+}
+
+// Replaces the current thread's resources until the end of the scope
+struct ScopedMemoryResources
+{
+    MemoryResources saved;
+
+    ScopedMemoryResources(const MemoryResources &resources) : saved(memory_resources())
+    {
+        memory_resources() = resources;
+    }
+
+    ScopedMemoryResources(const ScopedMemoryResources &) = delete;
+    ScopedMemoryResources &operator=(const ScopedMemoryResources &) = delete;
+
+    ~ScopedMemoryResources()
+    {
+        memory_resources() = saved;
+    }
+};
+
+constexpr size_t small_page_size = 4096;
+constexpr size_t huge_page_size = 2 << 20;
+
+// A snapshot of what a resource holds. TLB reach is what huge pages buy: the
+// same bytes take pages_2m() TLB entries instead of pages_4k().
+struct MemoryStats
+{
+    // Live allocations and their bytes
+    size_t allocations = 0;
+    size_t bytes = 0;
+    size_t peak_bytes = 0;
+    // Of bytes, those in 2MB-aligned regions backed or advised as huge pages
+    size_t huge_page_bytes = 0;
+    // Explicit huge page mappings that fell back to transparent ones
+    size_t fallbacks = 0;
+
+    size_t pages_4k() const { return (bytes - huge_page_bytes + small_page_size - 1) / small_page_size + huge_page_bytes / huge_page_size; }
+    size_t pages_2m() const { return (bytes + huge_page_size - 1) / huge_page_size; }
+};
+
+// Live and peak bytes, shared by the resources below
+struct MemoryCounters
+{
+    std::atomic<size_t> allocations = 0;
+    std::atomic<size_t> bytes = 0;
+    std::atomic<size_t> peak_bytes = 0;
+
+    void add(size_t n)
+    {
+        allocations++;
+        size_t now = bytes += n;
+        size_t peak = peak_bytes.load(std::memory_order_relaxed);
+        while (now > peak && !peak_bytes.compare_exchange_weak(peak, now, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    void remove(size_t n)
+    {
+        allocations--;
+        bytes -= n;
+    }
+
+    void snapshot(MemoryStats &stats) const
+    {
+        stats.allocations = allocations;
+        stats.bytes = bytes;
+        stats.peak_bytes = peak_bytes;
+    }
+};
+
+// Passes requests on to upstream and counts them, e.g. to measure how much
+// memory a graph takes
+struct CountingResource : std::pmr::memory_resource
+{
+    std::pmr::memory_resource *upstream;
+    MemoryCounters counters;
+
+    CountingResource(std::pmr::memory_resource *upstream = std::pmr::new_delete_resource()) : upstream(upstream) {}
+
+    MemoryStats stats() const
+    {
+        MemoryStats stats;
+        counters.snapshot(stats);
+        return stats;
+    }
+
+    void reset_peak()
+    {
+        counters.peak_bytes = counters.bytes.load();
+    }
+
+private:
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        void *p = upstream->allocate(bytes, alignment);
+        counters.add(bytes);
+        return p;
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override
+    {
+        counters.remove(bytes);
+        upstream->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+enum class HugePages
+{
+    // 4KB pages
+    None,
+    // 2MB-aligned mappings advised with MADV_HUGEPAGE; the kernel backs them
+    // with huge pages when it can
+    Transparent,
+    // MAP_HUGETLB from the reserved pool (vm.nr_hugepages), falling back to
+    // Transparent when the pool is empty
+    Explicit,
+};
+
+// Maps every allocation straight from the kernel, rounded up to whole pages.
+// Meant as the upstream of a pool resource, which carves its large chunks into
+// small objects.
+//
+// Linux places a page on the NUMA node of the thread that first writes it. With
+// prefault set the pages are written here, so memory lands on the node of the
+// thread that allocates it: give each worker its own pool over this resource
+// and its graph stays local to it.
+struct HugePageResource : std::pmr::memory_resource
+{
+    HugePages mode;
+    bool prefault;
+    MemoryCounters counters;
+    std::atomic<size_t> huge_page_bytes = 0;
+    std::atomic<size_t> fallbacks = 0;
+
+    HugePageResource(HugePages mode = HugePages::Transparent, bool prefault = true) : mode(mode), prefault(prefault) {}
+
+    MemoryStats stats() const
+    {
+        MemoryStats stats;
+        counters.snapshot(stats);
+        stats.huge_page_bytes = huge_page_bytes;
+        stats.fallbacks = fallbacks;
+        return stats;
+    }
+
+private:
+    size_t mapped_size(size_t bytes) const
+    {
+        size_t page = mode == HugePages::None ? small_page_size : huge_page_size;
+        return (std::max<size_t>(bytes, 1) + page - 1) / page * page;
+    }
+
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        assert(alignment <= huge_page_size);
+        size_t size = mapped_size(bytes);
+        void *p = MAP_FAILED;
+        bool huge = false;
+
+        if (mode == HugePages::Explicit)
+        {
+            p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p == MAP_FAILED)
+            {
+                fallbacks++;
+            }
+            huge = p != MAP_FAILED;
+        }
+        if (p == MAP_FAILED && mode != HugePages::None)
+        {
+            // Over-allocate and trim to get a 2MB-aligned region
+            char *raw = static_cast<char *>(mmap(nullptr, size + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            if (raw != MAP_FAILED)
+            {
+                char *aligned = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(raw) + huge_page_size - 1) / huge_page_size * huge_page_size);
+                if (aligned > raw)
+                {
+                    munmap(raw, aligned - raw);
+                }
+                munmap(aligned + size, raw + huge_page_size - aligned);
+                p = aligned;
+                huge = madvise(p, size, MADV_HUGEPAGE) == 0;
+            }
+        }
+        else if (mode == HugePages::None)
+        {
+            p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+        if (p == MAP_FAILED)
+        {
+            throw std::bad_alloc();
+        }
+
+        if (prefault)
+        {
+            size_t step = huge ? huge_page_size : small_page_size;
+            for (size_t k = 0; k < size; k += step)
+            {
+                static_cast<volatile char *>(p)[k] = 0;
+            }
+        }
+
+        counters.add(size);
+        if (huge)
+        {
+            huge_page_bytes += size;
+        }
+        return p;
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t) override
+    {
+        size_t size = mapped_size(bytes);
+        munmap(p, size);
+        counters.remove(size);
+        // Every mapping in a huge mode is whole 2MB pages, so this is exact
+        // unless some were refused by madvise
+        if (mode != HugePages::None)
+        {
+            size_t huge = huge_page_bytes.load();
+            while (!huge_page_bytes.compare_exchange_weak(huge, huge - std::min(huge, size)))
+            {
+            }
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+// Bytes of this process's memory the kernel currently backs with transparent
+// huge pages, from /proc/self/smaps_rollup. Returns 0 where that is unavailable.
+size_t anon_huge_page_bytes()
+{
+    std::ifstream file("/proc/self/smaps_rollup");
+    std::string key;
+    size_t kb;
+    while (file >> key)
+    {
+        if (key == "AnonHugePages:" && file >> kb)
+        {
+            return kb * 1024;
+        }
+        file.ignore(256, '\n');
+    }
+    return 0;
+}
@@ -1,13 +1,20 @@
+#pragma once
 #include <algorithm>
-#include <random>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #include <micrograd/engine.hpp>
+#include <micrograd/random.hpp>
 
 struct Module
 {
-    void zero_grad()
+    // All parameters, so that a frozen module doesn't keep the gradient it had
+    // before it was frozen
+    virtual void zero_grad()
     {
         for (auto &p : parameters())
         {
@@ -19,31 +26,262 @@ struct Module
     {
         return std::vector<Value>();
     }
+
+    // The parameters an optimizer should update: all of them except those of
+    // frozen modules
+    virtual std::vector<Value> trainable_parameters()
+    {
+        return parameters();
+    }
+
+    // A frozen module's parameters are constants. Its forward records no graph
+    // unless its inputs need a gradient, and backward never goes past it.
+    virtual void freeze(bool frozen = true) {}
+};
+
+// Allocator for arrays that should start on a cache line. Memory comes from
+// the thread's weights resource at the time the allocator is made, or the
+// heap if there is none.
+template <typename T, size_t Alignment = 64>
+struct AlignedAllocator
+{
+    using value_type = T;
+    std::pmr::memory_resource *resource = memory_resources().weights;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment> &other) : resource(other.resource) {}
+
+    T *allocate(size_t n)
+    {
+        if (resource == nullptr)
+        {
+            return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+        }
+        return static_cast<T *>(resource->allocate(n * sizeof(T), Alignment));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        if (resource == nullptr)
+        {
+            ::operator delete(p, std::align_val_t(Alignment));
+            return;
+        }
+        resource->deallocate(p, n * sizeof(T), Alignment);
+    }
+
+    bool operator==(const AlignedAllocator &other) const { return resource == other.resource; }
+};
+
+template <typename T>
+using aligned_vector = std::vector<T, AlignedAllocator<T>>;
+
+// Weights, biases and their gradients for `rows` neurons of `cols` inputs each,
+// in contiguous row-major arrays. Row j holds neuron j's weights and starts on
+// a cache line.
+//
+// Every entry also gets a Context whose data and grad refer into the arrays,
+// so that parameters are still Values. The Contexts are allocated together
+// and parameter Values share ownership of the whole block.
+struct ParameterBlock : std::enable_shared_from_this<ParameterBlock>
+{
+    size_t rows;
+    size_t cols;
+    // Row stride: cols rounded up to whole cache lines
+    size_t ld;
+    aligned_vector<float> weight;
+    aligned_vector<float> weight_grad;
+    aligned_vector<float> bias;
+    aligned_vector<float> bias_grad;
+    // Row j's weights then its bias, the order of Neuron::parameters()
+    Context *contexts;
+    // Guards weight_grad and bias_grad in a parallel backward(). It is the
+    // grad_guard of every Context below and the backward_guard of the layer
+    // nodes, so that they all add into the arrays under one lock.
+    std::atomic_flag grad_lock;
+
+    ParameterBlock(size_t rows, size_t cols)
+        : rows(rows), cols(cols), ld((cols + 15) / 16 * 16),
+          weight(rows * ld), weight_grad(rows * ld), bias(rows), bias_grad(rows)
+    {
+        contexts = AlignedAllocator<Context>(weight.get_allocator()).allocate(rows * (cols + 1));
+        for (size_t j = 0; j < rows; j++)
+        {
+            for (size_t i = 0; i < cols; i++)
+            {
+                new (&contexts[j * (cols + 1) + i]) Context(weight[j * ld + i], weight_grad[j * ld + i], "w[" + std::to_string(i) + "]");
+            }
+            new (&contexts[j * (cols + 1) + cols]) Context(bias[j], bias_grad[j], "b");
+        }
+        for (size_t k = 0; k < rows * (cols + 1); k++)
+        {
+            contexts[k].grad_guard = &grad_lock;
+        }
+    }
+
+    ParameterBlock(const ParameterBlock &) = delete;
+    ParameterBlock &operator=(const ParameterBlock &) = delete;
+
+    ~ParameterBlock()
+    {
+        for (size_t k = 0; k < rows * (cols + 1); k++)
+        {
+            contexts[k].~Context();
+        }
+        AlignedAllocator<Context>(weight.get_allocator()).deallocate(contexts, rows * (cols + 1));
+    }
+
+    // Row j's weight i, or its bias for i == cols
+    Value param(size_t j, size_t i)
+    {
+        return Value(std::shared_ptr<Context>(shared_from_this(), &contexts[j * (cols + 1) + i]));
+    }
+
+    // Fills rows [begin, end), numbering parameters in the order of parameters()
+    // from first_index
+    void initialize(const Initializer &init, uint64_t first_index, size_t fan_out, size_t begin, size_t end)
+    {
+        for (size_t j = begin; j < end; j++)
+        {
+            uint64_t index = first_index + j * (cols + 1);
+            for (size_t i = 0; i < cols; i++)
+            {
+                weight[j * ld + i] = init.weight(index + i, cols, fan_out);
+            }
+            bias[j] = init.bias(index + cols);
+        }
+    }
+
+    // Eight independent partial sums, so the compiler can vectorize the dot
+    // product without reassociating floating point adds
+    static float dot(const float *a, const float *b, size_t n)
+    {
+        float acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            for (size_t k = 0; k < 8; k++)
+            {
+                acc[k] += a[i + k] * b[i + k];
+            }
+        }
+        float sum = 0;
+        for (size_t k = 0; k < 8; k++)
+        {
+            sum += acc[k];
+        }
+        for (; i < n; i++)
+        {
+            sum += a[i] * b[i];
+        }
+        return sum;
+    }
+
+    // y = W x + b
+    void gemv(const float *x, float *y) const
+    {
+        for (size_t j = 0; j < rows; j++)
+        {
+            y[j] = bias[j] + dot(weight.data() + j * ld, x, cols);
+        }
+    }
+
+    // Given dz = dL/d(W x + b): accumulates dz x^T into the weight gradients and
+    // dz into the bias gradients of the rows marked trainable, and, if dx is
+    // not null, adds W^T dz to dx. Works through the columns in tiles, so the
+    // slices of x and dx being updated stay in L1 while the rows stream past.
+    void backward(const float *x, const float *dz, const std::vector<char> &trainable, float *dx)
+    {
+        const size_t tile = 256;
+        for (size_t c0 = 0; c0 < cols; c0 += tile)
+        {
+            const size_t c1 = std::min(cols, c0 + tile);
+            for (size_t j = 0; j < rows; j++)
+            {
+                const float g = dz[j];
+                if (g == 0)
+                {
+                    continue;
+                }
+                if (trainable[j])
+                {
+                    float *gj = weight_grad.data() + j * ld;
+                    for (size_t i = c0; i < c1; i++)
+                    {
+                        gj[i] += g * x[i];
+                    }
+                }
+                if (dx != nullptr)
+                {
+                    const float *wj = weight.data() + j * ld;
+                    for (size_t i = c0; i < c1; i++)
+                    {
+                        dx[i] += g * wj[i];
+                    }
+                }
+            }
+        }
+
+        for (size_t j = 0; j < rows; j++)
+        {
+            if (trainable[j])
+            {
+                bias_grad[j] += dz[j];
+            }
+        }
+    }
 };
 
 struct Neuron : Module
 {
     Value b;
     bool nonlin;
+    bool frozen = false;
     std::vector<Value> w;
 
-    Neuron(size_t nin, bool nonlin = true) : b(0), nonlin(nonlin)
+    Neuron(size_t nin, bool nonlin = true) : Neuron(nin, nonlin, Initializer(), 0, 1) {}
+
+    // Draws w[i] from parameter index first_index + i and b from the index
+    // after the last weight, the order of parameters()
+    Neuron(size_t nin, bool nonlin, const Initializer &init, uint64_t first_index, size_t fan_out)
+        : Neuron(make_block(nin, init, first_index, fan_out), 0, nonlin)
     {
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::uniform_real_distribution<Value::value_type> dist(-1.0, 1.0);
-        w.reserve(nin);
-        for (size_t i = 0; i < nin; i++)
+    }
+
+    // A view of row `row` of a layer's parameters
+    Neuron(const std::shared_ptr<ParameterBlock> &block, size_t row, bool nonlin)
+        : b(block->param(row, block->cols)), nonlin(nonlin)
+    {
+        w.reserve(block->cols);
+        for (size_t i = 0; i < block->cols; i++)
         {
-            w.emplace_back(Value(dist(gen)));
-            w.back().label() = "w[" + std::to_string(i) + "]";
+            w.push_back(block->param(row, i));
         }
-        b = Value(dist(gen), "b");
     }
 
+    static std::shared_ptr<ParameterBlock> make_block(size_t nin, const Initializer &init, uint64_t first_index, size_t fan_out)
+    {
+        auto block = std::make_shared<ParameterBlock>(1, nin);
+        block->initialize(init, first_index, fan_out, 0, 1);
+        return block;
+    }
+
+    Neuron(const Neuron &) = default;
+    Neuron(Neuron &&) = default;
+    Neuron &operator=(const Neuron &) = default;
+    Neuron &operator=(Neuron &&) = default;
+
     virtual ~Neuron() {}
 
-    auto operator()(std::vector<Value> &x)
+    Value operator()(const std::vector<Value> &x)
     {
         auto act = dot(w, x) + b;
         if (nonlin)
@@ -71,7 +309,22 @@ struct Neuron : Module
         return out;
     }
 
-    auto repr()
+    std::vector<Value> trainable_parameters()
+    {
+        return frozen ? std::vector<Value>() : parameters();
+    }
+
+    void freeze(bool frozen = true)
+    {
+        this->frozen = frozen;
+        for (auto &p : w)
+        {
+            p.requires_grad() = !frozen;
+        }
+        b.requires_grad() = !frozen;
+    }
+
+    auto repr() const
     {
         std::stringstream ss;
         ss << (nonlin ? "'ReLU'" : "'Linear'") << "Neuron(" << w.size() << ")";
@@ -81,27 +334,217 @@ struct Neuron : Module
 
 struct Layer : Module
 {
+    std::shared_ptr<ParameterBlock> block;
+    // Views of the rows of block
     std::vector<Neuron> neurons;
 
-    Layer(size_t nin, size_t nout, bool nonlin = true)
+    Layer(size_t nin, size_t nout, bool nonlin = true) : Layer(nin, nout, nonlin, Initializer()) {}
+
+    // Fills the weights in contiguous chunks of rows on up to num_threads
+    // threads. Parameter values do not depend on num_threads.
+    Layer(size_t nin, size_t nout, bool nonlin, const Initializer &init, uint64_t first_index = 0, size_t num_threads = 1)
+        : block(std::make_shared<ParameterBlock>(nout, nin))
     {
-        std::generate_n(std::back_inserter(neurons), nout, [&]()
-                        { return Neuron(nin, nonlin); });
+        size_t workers = std::max<size_t>(1, std::min(num_threads, nout));
+        parallel_for(workers, [&](size_t t)
+                     { block->initialize(init, first_index, nout, t * nout / workers, (t + 1) * nout / workers); });
+
+        neurons.reserve(nout);
+        for (size_t j = 0; j < nout; j++)
+        {
+            neurons.emplace_back(block, j, nonlin);
+        }
     }
 
+    Layer(const Layer &) = default;
+    Layer(Layer &&) = default;
+    Layer &operator=(const Layer &) = default;
+    Layer &operator=(Layer &&) = default;
+
     virtual ~Layer() {}
 
-    auto operator()(std::vector<Value> &x)
+    // State shared by one forward's layer node and its outputs. Also the
+    // layer node's attrs, so the graph can be exported.
+    struct Activation
     {
+        std::shared_ptr<ParameterBlock> block;
+        std::vector<char> nonlin;
+        std::vector<float> x;
+        // dL/d(W x + b), filled in by the outputs' backward
+        std::vector<float> dz;
+        std::vector<char> trainable;
+    };
+
+    // Adds a single "layer" node to the graph, fed by x, that computes W x + b
+    // over the contiguous weights, and one output node per neuron fed by it.
+    // The outputs' backward only store their gradient; the layer node runs
+    // after all of them and does the products with W for the whole layer.
+    std::vector<Value> operator()(const std::vector<Value> &x)
+    {
+        const size_t nin = block->cols;
+        const size_t nout = block->rows;
+        assert(x.size() == nin);
+
+        auto act = std::make_shared<Activation>();
+        act->block = block;
+        act->nonlin.resize(nout);
+        act->x.resize(nin);
+        act->trainable.resize(nout);
+        bool needs_graph = false;
+        for (size_t i = 0; i < nin; i++)
+        {
+            act->x[i] = x[i].data();
+            needs_graph |= x[i].requires_grad();
+        }
+        for (size_t j = 0; j < nout; j++)
+        {
+            act->nonlin[j] = neurons[j].nonlin;
+            act->trainable[j] = !neurons[j].frozen;
+            needs_graph |= !neurons[j].frozen;
+        }
+
+        std::vector<float> y(nout);
+        block->gemv(act->x.data(), y.data());
+        for (size_t j = 0; j < nout; j++)
+        {
+            if (neurons[j].nonlin)
+            {
+                y[j] = approx_tanh(y[j], math_mode());
+            }
+        }
+
         std::vector<Value> out;
-        out.reserve(neurons.size());
-        for (auto &n : neurons)
+        out.reserve(nout);
+
+        if (!needs_graph)
         {
-            out.emplace_back(n(x));
+            for (auto v : y)
+            {
+                out.push_back(Value::constant(v));
+            }
+            return out;
+        }
+
+        std::vector<std::shared_ptr<Context>> prev;
+        prev.reserve(nin);
+        for (auto &v : x)
+        {
+            prev.push_back(v.ctx_);
+        }
+        auto node = new_context(0, std::move(prev), "layer");
+        act->dz.assign(nout, 0);
+        node->attrs = act;
+        node->backward_guard = &block->grad_lock;
+
+        node->backward = [node = node.get(), act = act.get()]()
+        {
+            bool needs_dx = false;
+            for (auto &p : node->prev)
+            {
+                needs_dx |= p->requires_grad;
+            }
+
+            std::vector<float> dx(needs_dx ? act->x.size() : 0, 0.0f);
+            act->block->backward(act->x.data(), act->dz.data(), act->trainable, needs_dx ? dx.data() : nullptr);
+
+            for (size_t i = 0; i < dx.size(); i++)
+            {
+                if (node->prev[i]->requires_grad)
+                {
+                    node->prev[i]->grad += dx[i];
+                }
+            }
+            std::fill(act->dz.begin(), act->dz.end(), 0.0f);
+        };
+
+        for (size_t j = 0; j < nout; j++)
+        {
+            bool nonlin = neurons[j].nonlin;
+            auto o = new_context(y[j], std::initializer_list<std::shared_ptr<Context>>{node}, nonlin ? "tanh" : "+");
+            o->index = j;
+            o->backward = [o = o.get(), act, j, nonlin]()
+            {
+                act->dz[j] += nonlin ? (1 - o->data * o->data) * o->grad : o->grad;
+            };
+            out.push_back(Value(std::move(o)));
         }
         return out;
     }
 
+    // Forward pass on plain floats for a whole batch, without building a graph.
+    // Feature i of sample b is at x[i * batch + b], in the input and the result,
+    // so the inner loop runs over the batch with unit stride.
+    std::vector<float> predict(const std::vector<float> &x, size_t batch)
+    {
+        std::vector<float> out(neurons.size() * batch);
+        for (size_t j = 0; j < neurons.size(); j++)
+        {
+            auto &n = neurons[j];
+            const float *wj = block->weight.data() + j * block->ld;
+            float *acc = out.data() + j * batch;
+            std::fill(acc, acc + batch, block->bias[j]);
+            for (size_t i = 0; i < block->cols; i++)
+            {
+                const float w = wj[i];
+                const float *xi = x.data() + i * batch;
+                for (size_t b = 0; b < batch; b++)
+                {
+                    acc[b] += w * xi[b];
+                }
+            }
+            if (n.nonlin)
+            {
+                approx_tanh(acc, acc, batch, math_mode());
+            }
+        }
+        return out;
+    }
+
+    // Backward of predict() for every sample separately. x and y are the input
+    // and output of predict() and dy the gradient of each sample's loss with
+    // respect to y, all feature-major. Writes sample b's gradient of neuron j's
+    // w[i] to grads[b * stride + j * (nin + 1) + i] and of its bias after the
+    // weights, the order of parameters(). Returns the gradient of x.
+    std::vector<float> backward_per_sample(const std::vector<float> &x, const std::vector<float> &y,
+                                           std::vector<float> &dy, size_t batch, float *grads, size_t stride)
+    {
+        const size_t nin = x.size() / batch;
+        std::vector<float> dx(x.size(), 0.0f);
+
+        for (size_t j = 0; j < neurons.size(); j++)
+        {
+            auto &n = neurons[j];
+            float *dz = dy.data() + j * batch;
+            if (n.nonlin)
+            {
+                const float *yj = y.data() + j * batch;
+                for (size_t b = 0; b < batch; b++)
+                {
+                    dz[b] *= 1 - yj[b] * yj[b];
+                }
+            }
+
+            const float *wj = block->weight.data() + j * block->ld;
+            float *g = grads + j * (nin + 1);
+            for (size_t i = 0; i < nin; i++)
+            {
+                const float w = wj[i];
+                const float *xi = x.data() + i * batch;
+                float *dxi = dx.data() + i * batch;
+                for (size_t b = 0; b < batch; b++)
+                {
+                    g[b * stride + i] = dz[b] * xi[b];
+                    dxi[b] += w * dz[b];
+                }
+            }
+            for (size_t b = 0; b < batch; b++)
+            {
+                g[b * stride + nin] = dz[b];
+            }
+        }
+        return dx;
+    }
+
     std::vector<Value> parameters()
     {
         std::vector<Value> out;
@@ -115,7 +558,28 @@ struct Layer : Module
         return out;
     }
 
-    auto repr()
+    std::vector<Value> trainable_parameters()
+    {
+        std::vector<Value> out;
+        for (auto &n : neurons)
+        {
+            for (auto &p : n.trainable_parameters())
+            {
+                out.push_back(p);
+            }
+        }
+        return out;
+    }
+
+    void freeze(bool frozen = true)
+    {
+        for (auto &n : neurons)
+        {
+            n.freeze(frozen);
+        }
+    }
+
+    auto repr() const
     {
         std::stringstream ss;
         ss << "Layer of [" << join(", ", neurons) << "]";
@@ -123,11 +587,274 @@ struct Layer : Module
     }
 };
 
+// Lookup table of `vocab` rows of `dim` floats, with the gradient state needed
+// to update it sparsely. Rows touched by a backward since the last update are
+// listed in touched_rows, and so are the rows param() handed out: code holding
+// their Values can add to their gradient at any time.
+struct EmbeddingTable
+{
+    size_t vocab;
+    size_t dim;
+    aligned_vector<float> weight;
+    aligned_vector<float> weight_grad;
+    std::vector<char> touched;
+    std::vector<size_t> touched_rows;
+    std::vector<char> handed_out;
+    bool frozen = false;
+    // Built on first use by param(), one per entry
+    Context *contexts = nullptr;
+    std::once_flag contexts_built;
+    // Guards weight_grad and the touched rows in a parallel backward(), as a
+    // ParameterBlock's grad_lock does
+    std::atomic_flag grad_lock;
+
+    EmbeddingTable(size_t vocab, size_t dim)
+        : vocab(vocab), dim(dim), weight(vocab * dim), weight_grad(vocab * dim), touched(vocab), handed_out(vocab)
+    {
+    }
+
+    EmbeddingTable(const EmbeddingTable &) = delete;
+    EmbeddingTable &operator=(const EmbeddingTable &) = delete;
+
+    ~EmbeddingTable()
+    {
+        if (contexts != nullptr)
+        {
+            for (size_t k = 0; k < vocab * dim; k++)
+            {
+                contexts[k].~Context();
+            }
+            AlignedAllocator<Context>(weight.get_allocator()).deallocate(contexts, vocab * dim);
+        }
+    }
+
+    void touch(size_t row)
+    {
+        if (!touched[row])
+        {
+            touched[row] = 1;
+            touched_rows.push_back(row);
+        }
+    }
+
+    // Forgets the touched rows after an update, except those handed out
+    void clear_touched()
+    {
+        std::erase_if(touched_rows, [this](size_t row)
+                      {
+            touched[row] = handed_out[row];
+            return !handed_out[row]; });
+    }
+
+    // Entry k of row `row` as a Value, for code that works on parameters().
+    // The first call costs a Context per entry of the table. Safe to call from
+    // several threads, and during a parallel backward().
+    Value param(const std::shared_ptr<EmbeddingTable> &self, size_t row, size_t k)
+    {
+        std::call_once(contexts_built, [this]()
+                       {
+            auto built = AlignedAllocator<Context>(weight.get_allocator()).allocate(vocab * dim);
+            for (size_t i = 0; i < vocab * dim; i++)
+            {
+                new (&built[i]) Context(weight[i], weight_grad[i], "e[" + std::to_string(i / dim) + "]");
+                built[i].requires_grad = !frozen;
+                built[i].grad_guard = &grad_lock;
+            }
+            contexts = built; });
+
+        // touched_rows is also written by the lookups' backward
+        while (grad_lock.test_and_set(std::memory_order_acquire))
+        {
+            grad_lock.wait(true, std::memory_order_relaxed);
+        }
+        handed_out[row] = 1;
+        touch(row);
+        grad_lock.clear(std::memory_order_release);
+        grad_lock.notify_one();
+
+        return Value(std::shared_ptr<Context>(self, &contexts[row * dim + k]));
+    }
+};
+
+// Maps category ids to learned vectors. A lookup copies one row of the table
+// instead of multiplying a one-hot vector through a Layer, and its backward
+// only writes the gradient of that row. update() then applies SGD to the rows
+// touched since the last update, so a step costs O(rows used), not O(vocab).
+struct Embedding : Module
+{
+    std::shared_ptr<EmbeddingTable> table;
+
+    // Weights are drawn like those of a Layer(vocab, dim) fed a one-hot vector,
+    // with entry k of row r at parameter index first_index + r * dim + k
+    Embedding(size_t vocab, size_t dim, const Initializer &init = Initializer(), uint64_t first_index = 0, size_t num_threads = 1)
+        : table(std::make_shared<EmbeddingTable>(vocab, dim))
+    {
+        size_t workers = std::max<size_t>(1, std::min(num_threads, vocab));
+        parallel_for(workers, [&](size_t t)
+                     {
+            for (size_t i = t * vocab / workers * dim; i < (t + 1) * vocab / workers * dim; i++)
+            {
+                table->weight[i] = init.weight(first_index + i, vocab, dim);
+            } });
+    }
+
+    // State shared by one lookup's gather node and its outputs
+    struct Lookup
+    {
+        std::shared_ptr<EmbeddingTable> table;
+        std::vector<size_t> rows;
+        // dL/d(output), filled in by the outputs' backward
+        std::vector<float> dy;
+    };
+
+    // The rows for ids, concatenated. Adds one "embedding" node to the graph
+    // and one output per entry fed by it; the node scatters the outputs'
+    // gradients into the rows it read.
+    std::vector<Value> operator()(const std::vector<size_t> &ids)
+    {
+        const size_t dim = table->dim;
+        std::vector<Value> out;
+        out.reserve(ids.size() * dim);
+
+        if (table->frozen)
+        {
+            for (auto id : ids)
+            {
+                assert(id < table->vocab);
+                for (size_t k = 0; k < dim; k++)
+                {
+                    out.push_back(Value::constant(table->weight[id * dim + k]));
+                }
+            }
+            return out;
+        }
+
+        auto lookup = std::make_shared<Lookup>();
+        lookup->table = table;
+        lookup->rows = ids;
+        lookup->dy.assign(ids.size() * dim, 0);
+
+        auto node = new_context(0, std::vector<std::shared_ptr<Context>>(), "embedding");
+        node->attrs = lookup;
+        node->backward_guard = &table->grad_lock;
+        node->backward = [lookup = lookup.get()]()
+        {
+            auto &t = *lookup->table;
+            for (size_t r = 0; r < lookup->rows.size(); r++)
+            {
+                size_t row = lookup->rows[r];
+                float *g = t.weight_grad.data() + row * t.dim;
+                const float *dy = lookup->dy.data() + r * t.dim;
+                for (size_t k = 0; k < t.dim; k++)
+                {
+                    g[k] += dy[k];
+                }
+                t.touch(row);
+            }
+            std::fill(lookup->dy.begin(), lookup->dy.end(), 0.0f);
+        };
+
+        for (size_t r = 0; r < ids.size(); r++)
+        {
+            assert(ids[r] < table->vocab);
+            for (size_t k = 0; k < dim; k++)
+            {
+                auto o = new_context(table->weight[ids[r] * dim + k], std::initializer_list<std::shared_ptr<Context>>{node}, "gather");
+                o->index = r * dim + k;
+                o->backward = [o = o.get(), lookup]()
+                {
+                    lookup->dy[o->index] += o->grad;
+                };
+                out.push_back(Value(std::move(o)));
+            }
+        }
+        return out;
+    }
+
+    std::vector<Value> operator()(size_t id)
+    {
+        return (*this)(std::vector<size_t>{id});
+    }
+
+    // Sparse SGD: updates the rows touched since the last update and zeroes
+    // their gradients
+    void update(float lr)
+    {
+        auto &t = *table;
+        for (auto row : t.touched_rows)
+        {
+            float *w = t.weight.data() + row * t.dim;
+            float *g = t.weight_grad.data() + row * t.dim;
+            for (size_t k = 0; k < t.dim; k++)
+            {
+                w[k] -= lr * g[k];
+                g[k] = 0;
+            }
+        }
+        t.clear_touched();
+    }
+
+    // Only the touched rows can have a gradient
+    void zero_grad()
+    {
+        auto &t = *table;
+        for (auto row : t.touched_rows)
+        {
+            std::fill(t.weight_grad.begin() + row * t.dim, t.weight_grad.begin() + (row + 1) * t.dim, 0.0f);
+        }
+        t.clear_touched();
+    }
+
+    // Every entry as a Value. Dense, so O(vocab * dim), and the rows handed out
+    // stay in every later update() and zero_grad(): prefer update() on lookups
+    // for training.
+    std::vector<Value> parameters()
+    {
+        std::vector<Value> out;
+        out.reserve(table->vocab * table->dim);
+        for (size_t row = 0; row < table->vocab; row++)
+        {
+            for (size_t k = 0; k < table->dim; k++)
+            {
+                out.push_back(table->param(table, row, k));
+            }
+        }
+        return out;
+    }
+
+    std::vector<Value> trainable_parameters()
+    {
+        return table->frozen ? std::vector<Value>() : parameters();
+    }
+
+    void freeze(bool frozen = true)
+    {
+        table->frozen = frozen;
+        if (table->contexts != nullptr)
+        {
+            for (size_t i = 0; i < table->vocab * table->dim; i++)
+            {
+                table->contexts[i].requires_grad = !frozen;
+            }
+        }
+    }
+
+    auto repr() const
+    {
+        std::stringstream ss;
+        ss << "Embedding(" << table->vocab << ", " << table->dim << ")";
+        return ss.str();
+    }
+};
+
 struct MLP : Module
 {
     std::vector<Layer> layers;
 
-    MLP(size_t nin, std::vector<size_t> nouts)
+    // With the same initializer seed, the weights are identical for any
+    // num_threads
+    MLP(size_t nin, std::vector<size_t> nouts, const Initializer &init = Initializer(),
+        size_t num_threads = 1)
     {
         std::vector<size_t> sz;
         sz.push_back(nin);
@@ -136,30 +863,131 @@ struct MLP : Module
             sz.push_back(v);
         }
 
+        uint64_t first_index = 0;
         for (size_t i = 0; i < nouts.size(); i++)
         {
-            layers.push_back(Layer(sz[i], sz[i + 1]));
+            layers.push_back(Layer(sz[i], sz[i + 1], true, init, first_index, num_threads));
+            first_index += sz[i + 1] * (sz[i] + 1);
         }
     }
 
     virtual ~MLP() {}
 
-    auto operator()(std::vector<Value> &x)
+    std::vector<Value> operator()(const std::vector<Value> &x)
     {
-        for (auto layer : layers)
+        if (layers.empty())
         {
-            x = layer(x);
+            return x;
         }
-
-        return x;
+        auto out = layers[0](x);
+        for (size_t l = 1; l < layers.size(); l++)
+        {
+            out = layers[l](out);
+        }
+        return out;
     }
 
-    auto operator()(std::vector<float> &x)
+    std::vector<Value> operator()(const std::vector<float> &x)
     {
         auto xv = to_values(x);
         return (*this)(xv);
     }
 
+    // Evaluates a batch of samples in one pass over the weights, without
+    // building a graph. For inference only.
+    std::vector<std::vector<float>> predict(const std::vector<std::vector<float>> &xs)
+    {
+        const size_t batch = xs.size();
+        if (batch == 0)
+        {
+            return {};
+        }
+
+        const size_t nin = xs.front().size();
+        std::vector<float> x(nin * batch);
+        for (size_t b = 0; b < batch; b++)
+        {
+            assert(xs[b].size() == nin);
+            for (size_t i = 0; i < nin; i++)
+            {
+                x[i * batch + b] = xs[b][i];
+            }
+        }
+
+        for (auto &layer : layers)
+        {
+            x = layer.predict(x, batch);
+        }
+
+        const size_t nout = x.size() / batch;
+        std::vector<std::vector<float>> out(batch, std::vector<float>(nout));
+        for (size_t b = 0; b < batch; b++)
+        {
+            for (size_t j = 0; j < nout; j++)
+            {
+                out[b][j] = x[j * batch + b];
+            }
+        }
+        return out;
+    }
+
+    // Gradient of each sample's loss with respect to every parameter, as a
+    // [batch][parameters().size()] matrix in the order of parameters(). The
+    // network has a single output y and dys[b] is the derivative of sample b's
+    // loss with respect to it, e.g. 2 * (y - target) for a squared error. Runs
+    // one forward and one backward over the whole batch on plain floats instead
+    // of a graph and a backward() per sample.
+    std::vector<std::vector<float>> per_sample_gradients(const std::vector<std::vector<float>> &xs, const std::vector<float> &dys)
+    {
+        assert(xs.size() == dys.size());
+        assert(!layers.empty() && layers.back().neurons.size() == 1);
+        const size_t batch = xs.size();
+        if (batch == 0)
+        {
+            return {};
+        }
+
+        const size_t nin = xs.front().size();
+        std::vector<std::vector<float>> acts(layers.size() + 1);
+        acts[0].resize(nin * batch);
+        for (size_t b = 0; b < batch; b++)
+        {
+            assert(xs[b].size() == nin);
+            for (size_t i = 0; i < nin; i++)
+            {
+                acts[0][i * batch + b] = xs[b][i];
+            }
+        }
+
+        for (size_t l = 0; l < layers.size(); l++)
+        {
+            acts[l + 1] = layers[l].predict(acts[l], batch);
+        }
+
+        // Offset of each layer's first parameter within a row
+        std::vector<size_t> offsets(layers.size() + 1, 0);
+        for (size_t l = 0; l < layers.size(); l++)
+        {
+            const size_t lin = acts[l].size() / batch;
+            offsets[l + 1] = offsets[l] + layers[l].neurons.size() * (lin + 1);
+        }
+        const size_t stride = offsets.back();
+        std::vector<float> grads(batch * stride);
+
+        std::vector<float> dy = dys;
+        for (size_t l = layers.size(); l-- > 0;)
+        {
+            dy = layers[l].backward_per_sample(acts[l], acts[l + 1], dy, batch, grads.data() + offsets[l], stride);
+        }
+
+        std::vector<std::vector<float>> out(batch);
+        for (size_t b = 0; b < batch; b++)
+        {
+            out[b].assign(grads.begin() + b * stride, grads.begin() + (b + 1) * stride);
+        }
+        return out;
+    }
+
     std::vector<Value> parameters()
     {
         std::vector<Value> out;
@@ -173,7 +1001,28 @@ struct MLP : Module
         return out;
     }
 
-    auto repr()
+    std::vector<Value> trainable_parameters()
+    {
+        std::vector<Value> out;
+        for (auto &layer : layers)
+        {
+            for (auto &p : layer.trainable_parameters())
+            {
+                out.push_back(p);
+            }
+        }
+        return out;
+    }
+
+    void freeze(bool frozen = true)
+    {
+        for (auto &layer : layers)
+        {
+            layer.freeze(frozen);
+        }
+    }
+
+    auto repr() const
     {
         std::stringstream ss;
         ss << "MLP of [" << join(", ", layers) << "]";
@@ -0,0 +1,318 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <micrograd/engine.hpp>
+#include <micrograd/nn.hpp>
+
+// Blocking FIFO used to pass work between pipeline stages
+template <typename T>
+struct Channel
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<T> items;
+
+    void push(T item)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            items.push_back(std::move(item));
+        }
+        cv.notify_one();
+    }
+
+    T pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]()
+                { return !items.empty(); });
+        T item = std::move(items.front());
+        items.pop_front();
+        return item;
+    }
+};
+
+struct PipelineMessage
+{
+    enum Kind
+    {
+        Forward,
+        Backward,
+        Stop
+    };
+
+    Kind kind;
+    size_t micro_batch = 0;
+    // One row per sample: activations for Forward, their gradients for Backward
+    std::vector<std::vector<float>> data;
+};
+
+struct PipelineStage
+{
+    size_t index;
+    size_t first_layer;
+    size_t last_layer;
+    Channel<PipelineMessage> inbox;
+    std::thread thread;
+
+    // Graph ends kept for each micro-batch between its forward and backward
+    struct Saved
+    {
+        std::vector<std::vector<Value>> inputs;
+        std::vector<std::vector<Value>> outputs;
+    };
+    std::unordered_map<size_t, Saved> saved;
+    size_t backwards_done = 0;
+};
+
+// Trains an MLP with its layers split into contiguous stages, each running on
+// its own thread. A step splits the batch into micro-batches that stream
+// through the stages, so stage k can run the forward of micro-batch m while
+// stage k + 1 works on micro-batch m - 1. Each stage handles forward and
+// backward work in arrival order, and the last stage runs a micro-batch's
+// backward as soon as its forward is done (1F1B at the tail of the pipe).
+//
+// Stages exchange plain floats rather than Values, so every stage owns its own
+// graph and parameters are only ever touched by the thread of their stage.
+// Gradients accumulate over all micro-batches of a step, and each stage
+// applies its update as soon as its last backward has run.
+//
+// The loss is the same sum of squared errors used in main.cpp, so a step gives
+// the same update as running the whole batch through the model at once.
+struct PipelineTrainer
+{
+    MLP &model;
+    size_t micro_batch_size;
+    std::vector<std::unique_ptr<PipelineStage>> stages;
+
+    // State of the current step, written before any work is queued
+    const std::vector<float> *targets = nullptr;
+    size_t num_micro_batches = 0;
+    float lr = 0;
+    float loss = 0;
+    Channel<size_t> done;
+
+    PipelineTrainer(MLP &model, size_t num_stages, size_t micro_batch_size)
+        : model(model), micro_batch_size(micro_batch_size)
+    {
+        assert(micro_batch_size > 0);
+        num_stages = std::max<size_t>(1, std::min(num_stages, model.layers.size()));
+
+        // Split layers as evenly as possible, earlier stages take the remainder
+        size_t first = 0;
+        for (size_t i = 0; i < num_stages; i++)
+        {
+            size_t count = model.layers.size() / num_stages + (i < model.layers.size() % num_stages);
+            auto stage = std::make_unique<PipelineStage>();
+            stage->index = i;
+            stage->first_layer = first;
+            stage->last_layer = first + count;
+            stages.push_back(std::move(stage));
+            first += count;
+        }
+
+        model.zero_grad();
+
+        for (auto &stage : stages)
+        {
+            stage->thread = std::thread([this, s = stage.get(), mode = math_mode()]()
+                                        {
+                ScopedMathMode scope(mode);
+                run(*s); });
+        }
+    }
+
+    PipelineTrainer(const PipelineTrainer &) = delete;
+    PipelineTrainer &operator=(const PipelineTrainer &) = delete;
+
+    ~PipelineTrainer()
+    {
+        for (auto &stage : stages)
+        {
+            stage->inbox.push({PipelineMessage::Stop});
+        }
+        for (auto &stage : stages)
+        {
+            stage->thread.join();
+        }
+    }
+
+    // Runs one optimizer step over the batch and returns its loss
+    float step(const std::vector<std::vector<float>> &xs, const std::vector<float> &ys, float lr)
+    {
+        assert(!xs.empty() && xs.size() == ys.size());
+
+        this->targets = &ys;
+        this->lr = lr;
+        this->loss = 0;
+        num_micro_batches = (xs.size() + micro_batch_size - 1) / micro_batch_size;
+
+        for (size_t m = 0; m < num_micro_batches; m++)
+        {
+            PipelineMessage msg{PipelineMessage::Forward, m};
+            for (size_t i = m * micro_batch_size; i < std::min(xs.size(), (m + 1) * micro_batch_size); i++)
+            {
+                msg.data.push_back(xs[i]);
+            }
+            stages.front()->inbox.push(std::move(msg));
+        }
+
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            done.pop();
+        }
+
+        return loss;
+    }
+
+    void run(PipelineStage &stage)
+    {
+        while (true)
+        {
+            auto msg = stage.inbox.pop();
+
+            if (msg.kind == PipelineMessage::Stop)
+            {
+                return;
+            }
+
+            if (msg.kind == PipelineMessage::Forward)
+            {
+                forward(stage, msg);
+            }
+            else
+            {
+                backward(stage, msg);
+            }
+        }
+    }
+
+    void forward(PipelineStage &stage, PipelineMessage &msg)
+    {
+        PipelineStage::Saved saved;
+
+        for (auto &row : msg.data)
+        {
+            // The first stage's inputs are data; later stages need the
+            // gradient of their inputs to pass back up the pipe.
+            auto x = stage.index == 0 ? to_values(row) : to_leaf_values(row);
+            saved.inputs.push_back(x);
+            for (size_t l = stage.first_layer; l < stage.last_layer; l++)
+            {
+                x = model.layers[l](x);
+            }
+            saved.outputs.push_back(x);
+        }
+
+        if (&stage != stages.back().get())
+        {
+            PipelineMessage out{PipelineMessage::Forward, msg.micro_batch};
+            for (auto &row : saved.outputs)
+            {
+                out.data.push_back(data_of(row));
+            }
+            stage.saved.emplace(msg.micro_batch, std::move(saved));
+            stages[stage.index + 1]->inbox.push(std::move(out));
+            return;
+        }
+
+        auto mb_loss = Value::constant(0.0);
+        for (size_t i = 0; i < saved.outputs.size(); i++)
+        {
+            float ygt = (*targets)[msg.micro_batch * micro_batch_size + i];
+            Value sub = saved.outputs[i][0] - ygt;
+            mb_loss += sub.square();
+        }
+        loss += mb_loss.data();
+
+        mb_loss.backward();
+        finish_backward(stage, msg.micro_batch, saved);
+    }
+
+    void backward(PipelineStage &stage, PipelineMessage &msg)
+    {
+        auto it = stage.saved.find(msg.micro_batch);
+        assert(it != stage.saved.end());
+        auto saved = std::move(it->second);
+        stage.saved.erase(it);
+
+        std::vector<Value> roots;
+        std::vector<Value::value_type> grads;
+        for (size_t i = 0; i < saved.outputs.size(); i++)
+        {
+            for (size_t j = 0; j < saved.outputs[i].size(); j++)
+            {
+                roots.push_back(saved.outputs[i][j]);
+                grads.push_back(msg.data[i][j]);
+            }
+        }
+        ::backward(roots, grads);
+
+        finish_backward(stage, msg.micro_batch, saved);
+    }
+
+    // Sends the input gradients up the pipe, and applies this stage's update
+    // once every micro-batch of the step has been through it.
+    void finish_backward(PipelineStage &stage, size_t micro_batch, PipelineStage::Saved &saved)
+    {
+        if (stage.index > 0)
+        {
+            PipelineMessage out{PipelineMessage::Backward, micro_batch};
+            for (auto &row : saved.inputs)
+            {
+                std::vector<float> g;
+                g.reserve(row.size());
+                for (auto &v : row)
+                {
+                    g.push_back(v.grad());
+                }
+                out.data.push_back(std::move(g));
+            }
+            stages[stage.index - 1]->inbox.push(std::move(out));
+        }
+
+        if (++stage.backwards_done < num_micro_batches)
+        {
+            return;
+        }
+        stage.backwards_done = 0;
+
+        for (size_t l = stage.first_layer; l < stage.last_layer; l++)
+        {
+            for (auto &p : model.layers[l].trainable_parameters())
+            {
+                p.data() += -(p.grad() * lr);
+                p.grad() = 0;
+            }
+        }
+        done.push(stage.index);
+    }
+
+    static std::vector<Value> to_leaf_values(const std::vector<float> &row)
+    {
+        std::vector<Value> out;
+        out.reserve(row.size());
+        for (auto v : row)
+        {
+            out.emplace_back(Value(v));
+        }
+        return out;
+    }
+
+    static std::vector<float> data_of(const std::vector<Value> &row)
+    {
+        std::vector<float> out;
+        out.reserve(row.size());
+        for (auto &v : row)
+        {
+            out.push_back(v.data());
+        }
+        return out;
+    }
+};
@@ -0,0 +1,108 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3").
+// A counter-based generator: the output is a pure function of the counter and
+// the key, so any element of the stream can be computed independently, in any
+// order and on any thread.
+std::array<uint32_t, 4> philox4x32(std::array<uint32_t, 4> ctr, std::array<uint32_t, 2> key)
+{
+    const uint32_t m0 = 0xD2511F53;
+    const uint32_t m1 = 0xCD9E8D57;
+    const uint32_t w0 = 0x9E3779B9;
+    const uint32_t w1 = 0xBB67AE85;
+
+    for (int round = 0; round < 10; round++)
+    {
+        uint64_t p0 = static_cast<uint64_t>(m0) * ctr[0];
+        uint64_t p1 = static_cast<uint64_t>(m1) * ctr[2];
+        ctr = {static_cast<uint32_t>(p1 >> 32) ^ ctr[1] ^ key[0], static_cast<uint32_t>(p1),
+               static_cast<uint32_t>(p0 >> 32) ^ ctr[3] ^ key[1], static_cast<uint32_t>(p0)};
+        key[0] += w0;
+        key[1] += w1;
+    }
+    return ctr;
+}
+
+// Runs fn(0) .. fn(n - 1), each on its own thread. Task 0 runs on the calling
+// thread, so n == 1 costs nothing extra.
+void parallel_for(size_t n, const std::function<void(size_t)> &fn)
+{
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < n; i++)
+    {
+        threads.emplace_back(fn, i);
+    }
+    if (n > 0)
+    {
+        fn(0);
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+}
+
+enum class Init
+{
+    // U(-1, 1) for weights and biases, as in micrograd
+    Uniform,
+    // Xavier/Glorot uniform, U(-a, a) with a = sqrt(6 / (fan_in + fan_out)), zero bias
+    Xavier,
+    // He/Kaiming uniform, U(-a, a) with a = sqrt(6 / fan_in), zero bias
+    He,
+};
+
+// The seed of a default-constructed Initializer: a fixed one plus the number
+// made before it. Models built one after another differ, and a program builds
+// the same ones on every run.
+uint64_t next_default_seed()
+{
+    static std::atomic<uint64_t> next = 0x9E3779B97F4A7C15;
+    return next++;
+}
+
+// Draws parameter values for a model. The value of a parameter depends only on
+// the seed and its index in the model's parameters(), so a model comes out
+// bit-identical no matter how many threads build it.
+struct Initializer
+{
+    Init scheme;
+    uint64_t seed;
+
+    Initializer(Init scheme = Init::Uniform) : scheme(scheme), seed(next_default_seed()) {}
+    Initializer(Init scheme, uint64_t seed) : scheme(scheme), seed(seed) {}
+
+    // Uniform in [0, 1) from the 24 high bits of the index's first Philox word
+    float uniform(uint64_t index) const
+    {
+        auto r = philox4x32({static_cast<uint32_t>(index), static_cast<uint32_t>(index >> 32), 0, 0},
+                            {static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)});
+        return (r[0] >> 8) * (1.0f / 16777216.0f);
+    }
+
+    float weight(uint64_t index, size_t fan_in, size_t fan_out) const
+    {
+        float bound = 1.0f;
+        if (scheme == Init::Xavier)
+        {
+            bound = std::sqrt(6.0f / (fan_in + fan_out));
+        }
+        else if (scheme == Init::He)
+        {
+            bound = std::sqrt(6.0f / fan_in);
+        }
+        return (2 * uniform(index) - 1) * bound;
+    }
+
+    float bias(uint64_t index) const
+    {
+        return scheme == Init::Uniform ? 2 * uniform(index) - 1 : 0.0f;
+    }
+};
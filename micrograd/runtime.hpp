@@ -0,0 +1,424 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <micrograd/approx.hpp>
+
+// Standalone runtime for graphs exported with export_ir() from ir.hpp. It only
+// needs the standard library and approx.hpp: no Values, shared_ptrs or
+// std::functions, just flat arrays of instructions, values and parameters.
+//
+// File format, all fields in host byte order:
+//
+//   char[4]   magic "MGIR"
+//   uint32    version
+//   uint32    number of inputs, parameters, instructions and outputs
+//   float     parameter values
+//   instr     instructions in topological order
+//   uint32    output instruction indices
+//
+// An instruction is a uint8 opcode followed by its operands:
+//
+//   Const     float value
+//   Input     uint32 input index
+//   Param     uint32 parameter slot
+//   Add, Mul, Pow, Sub, Div    uint32 a, uint32 b (instruction indices)
+//   Tanh, Exp, Neg, Square, Reciprocal
+//                              uint32 a
+//   AddScalar, MulScalar, PowScalar
+//                              uint32 a, float scalar operand
+//   Layer     uint32 nin, nout, first parameter slot, then nout uint8 nonlin
+//             flags and nin input instruction indices. Weights are nout rows
+//             of nin, followed by nout biases. Produces nout values.
+//   LayerOut  uint32 layer instruction, uint32 output index
+enum class IrOp : uint8_t
+{
+    Const,
+    Input,
+    Param,
+    Add,
+    Mul,
+    Tanh,
+    Exp,
+    Pow,
+    Layer,
+    LayerOut,
+    Sub,
+    Div,
+    Neg,
+    Square,
+    Reciprocal,
+    AddScalar,
+    MulScalar,
+    PowScalar,
+};
+
+// Version 2 added Sub through PowScalar, which version 1 runtimes can't read
+const uint32_t ir_version = 2;
+
+struct IrInstr
+{
+    IrOp op;
+    // Operands; for Layer: nin, nout and first parameter slot
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t c = 0;
+    // Const's value, or the scalar operand of AddScalar and the like
+    float value = 0;
+    // Where this instruction's result(s) live in the value array
+    uint32_t offset = 0;
+    // Layer inputs and nonlin flags in IrProgram::args
+    uint32_t args = 0;
+};
+
+struct IrProgram
+{
+    uint32_t num_inputs = 0;
+    std::vector<float> params;
+    std::vector<IrInstr> instrs;
+    std::vector<uint32_t> args;
+    std::vector<uint32_t> outputs;
+
+    std::vector<float> values;
+    std::vector<float> grads;
+    std::vector<float> param_grads;
+
+    bool load(const std::string &filename)
+    {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file)
+        {
+            return false;
+        }
+        std::vector<char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        return parse(bytes.data(), bytes.size());
+    }
+
+    bool parse(const char *data, size_t size)
+    {
+        size_t pos = 0;
+        auto read = [&](void *out, size_t n)
+        {
+            if (pos + n > size)
+            {
+                return false;
+            }
+            std::memcpy(out, data + pos, n);
+            pos += n;
+            return true;
+        };
+
+        char magic[4];
+        uint32_t version, num_params, num_instrs, num_outputs;
+        if (!read(magic, 4) || std::memcmp(magic, "MGIR", 4) != 0 || !read(&version, 4) || version != ir_version ||
+            !read(&num_inputs, 4) || !read(&num_params, 4) || !read(&num_instrs, 4) || !read(&num_outputs, 4))
+        {
+            return false;
+        }
+
+        params.resize(num_params);
+        if (!read(params.data(), num_params * sizeof(float)))
+        {
+            return false;
+        }
+
+        instrs.clear();
+        args.clear();
+        uint32_t num_values = 0;
+        for (uint32_t k = 0; k < num_instrs; k++)
+        {
+            IrInstr in;
+            if (!read(&in.op, 1))
+            {
+                return false;
+            }
+            bool ok = true;
+            uint32_t width = 1;
+            switch (in.op)
+            {
+            case IrOp::Const:
+                ok = read(&in.value, 4);
+                break;
+            case IrOp::Input:
+                ok = read(&in.a, 4) && in.a < num_inputs;
+                break;
+            case IrOp::Param:
+                ok = read(&in.a, 4) && in.a < num_params;
+                break;
+            case IrOp::Add:
+            case IrOp::Mul:
+            case IrOp::Pow:
+            case IrOp::Sub:
+            case IrOp::Div:
+                ok = read(&in.a, 4) && read(&in.b, 4) && in.a < k && in.b < k;
+                break;
+            case IrOp::Tanh:
+            case IrOp::Exp:
+            case IrOp::Neg:
+            case IrOp::Square:
+            case IrOp::Reciprocal:
+                ok = read(&in.a, 4) && in.a < k;
+                break;
+            case IrOp::AddScalar:
+            case IrOp::MulScalar:
+            case IrOp::PowScalar:
+                ok = read(&in.a, 4) && read(&in.value, 4) && in.a < k;
+                break;
+            case IrOp::Layer:
+                ok = read(&in.a, 4) && read(&in.b, 4) && read(&in.c, 4) &&
+                     uint64_t(in.c) + uint64_t(in.b) * (in.a + 1) <= num_params;
+                in.args = args.size();
+                for (uint32_t j = 0; ok && j < in.b; j++)
+                {
+                    uint8_t nonlin = 0;
+                    ok = read(&nonlin, 1);
+                    args.push_back(nonlin);
+                }
+                for (uint32_t i = 0; ok && i < in.a; i++)
+                {
+                    uint32_t src = 0;
+                    ok = read(&src, 4) && src < k;
+                    args.push_back(src);
+                }
+                width = in.b;
+                break;
+            case IrOp::LayerOut:
+                ok = read(&in.a, 4) && read(&in.b, 4) && in.a < k &&
+                     instrs[in.a].op == IrOp::Layer && in.b < instrs[in.a].b;
+                break;
+            default:
+                ok = false;
+            }
+            if (!ok)
+            {
+                return false;
+            }
+            in.offset = num_values;
+            num_values += width;
+            instrs.push_back(in);
+        }
+
+        outputs.resize(num_outputs);
+        if (!read(outputs.data(), num_outputs * 4))
+        {
+            return false;
+        }
+        for (auto o : outputs)
+        {
+            if (o >= num_instrs)
+            {
+                return false;
+            }
+        }
+
+        values.assign(num_values, 0.0f);
+        grads.assign(num_values, 0.0f);
+        param_grads.assign(num_params, 0.0f);
+        return pos == size;
+    }
+
+    float value_of(uint32_t instr) const { return values[instrs[instr].offset]; }
+
+    // Returns no outputs if inputs is not num_inputs long
+    std::vector<float> forward(const std::vector<float> &inputs)
+    {
+        if (inputs.size() != num_inputs)
+        {
+            std::cerr << "forward: expected " << num_inputs << " inputs, got " << inputs.size() << std::endl;
+            return {};
+        }
+
+        for (auto &in : instrs)
+        {
+            float *out = values.data() + in.offset;
+            switch (in.op)
+            {
+            case IrOp::Const:
+                *out = in.value;
+                break;
+            case IrOp::Input:
+                *out = inputs[in.a];
+                break;
+            case IrOp::Param:
+                *out = params[in.a];
+                break;
+            case IrOp::Add:
+                *out = value_of(in.a) + value_of(in.b);
+                break;
+            case IrOp::Mul:
+                *out = value_of(in.a) * value_of(in.b);
+                break;
+            case IrOp::Pow:
+                *out = approx_pow(value_of(in.a), value_of(in.b), math_mode());
+                break;
+            case IrOp::Tanh:
+                *out = approx_tanh(value_of(in.a), math_mode());
+                break;
+            case IrOp::Exp:
+                *out = approx_exp(value_of(in.a), math_mode());
+                break;
+            case IrOp::Sub:
+                *out = value_of(in.a) - value_of(in.b);
+                break;
+            case IrOp::Div:
+                *out = value_of(in.a) / value_of(in.b);
+                break;
+            case IrOp::Neg:
+                *out = -value_of(in.a);
+                break;
+            case IrOp::Square:
+                *out = value_of(in.a) * value_of(in.a);
+                break;
+            case IrOp::Reciprocal:
+                *out = 1 / value_of(in.a);
+                break;
+            case IrOp::AddScalar:
+                *out = value_of(in.a) + in.value;
+                break;
+            case IrOp::MulScalar:
+                *out = value_of(in.a) * in.value;
+                break;
+            case IrOp::PowScalar:
+                *out = approx_pow(value_of(in.a), in.value, math_mode());
+                break;
+            case IrOp::Layer:
+            {
+                const float *w = params.data() + in.c;
+                const float *bias = w + in.a * in.b;
+                const uint32_t *src = args.data() + in.args + in.b;
+                for (uint32_t j = 0; j < in.b; j++)
+                {
+                    float z = bias[j];
+                    for (uint32_t i = 0; i < in.a; i++)
+                    {
+                        z += w[j * in.a + i] * value_of(src[i]);
+                    }
+                    out[j] = args[in.args + j] ? approx_tanh(z, math_mode()) : z;
+                }
+                break;
+            }
+            case IrOp::LayerOut:
+                *out = values[instrs[in.a].offset + in.b];
+                break;
+            }
+        }
+
+        std::vector<float> result;
+        result.reserve(outputs.size());
+        for (auto o : outputs)
+        {
+            result.push_back(value_of(o));
+        }
+        return result;
+    }
+
+    // Backpropagates from the outputs of the last forward(), seeded with
+    // output_grads, and returns the gradient of every parameter. They are all
+    // zero if output_grads does not have one entry per output.
+    const std::vector<float> &backward(const std::vector<float> &output_grads)
+    {
+        std::fill(grads.begin(), grads.end(), 0.0f);
+        std::fill(param_grads.begin(), param_grads.end(), 0.0f);
+        if (output_grads.size() != outputs.size())
+        {
+            std::cerr << "backward: expected " << outputs.size() << " output gradients, got " << output_grads.size() << std::endl;
+            return param_grads;
+        }
+        for (size_t k = 0; k < outputs.size(); k++)
+        {
+            grads[instrs[outputs[k]].offset] += output_grads[k];
+        }
+
+        for (size_t k = instrs.size(); k-- > 0;)
+        {
+            auto &in = instrs[k];
+            const float g = grads[in.offset];
+            switch (in.op)
+            {
+            case IrOp::Const:
+            case IrOp::Input:
+                break;
+            case IrOp::Param:
+                param_grads[in.a] += g;
+                break;
+            case IrOp::Add:
+                grads[instrs[in.a].offset] += g;
+                grads[instrs[in.b].offset] += g;
+                break;
+            case IrOp::Mul:
+                grads[instrs[in.a].offset] += value_of(in.b) * g;
+                grads[instrs[in.b].offset] += value_of(in.a) * g;
+                break;
+            case IrOp::Pow:
+                grads[instrs[in.a].offset] += value_of(in.b) * approx_pow(value_of(in.a), value_of(in.b) - 1, math_mode()) * g;
+                if (value_of(in.a) > 0)
+                {
+                    grads[instrs[in.b].offset] += values[in.offset] * approx_log(value_of(in.a), math_mode()) * g;
+                }
+                break;
+            case IrOp::Tanh:
+                grads[instrs[in.a].offset] += (1 - values[in.offset] * values[in.offset]) * g;
+                break;
+            case IrOp::Exp:
+                grads[instrs[in.a].offset] += values[in.offset] * g;
+                break;
+            case IrOp::Sub:
+                grads[instrs[in.a].offset] += g;
+                grads[instrs[in.b].offset] -= g;
+                break;
+            case IrOp::Div:
+                grads[instrs[in.a].offset] += g / value_of(in.b);
+                grads[instrs[in.b].offset] -= values[in.offset] / value_of(in.b) * g;
+                break;
+            case IrOp::Neg:
+                grads[instrs[in.a].offset] -= g;
+                break;
+            case IrOp::Square:
+                grads[instrs[in.a].offset] += 2 * value_of(in.a) * g;
+                break;
+            case IrOp::Reciprocal:
+                grads[instrs[in.a].offset] -= values[in.offset] * values[in.offset] * g;
+                break;
+            case IrOp::AddScalar:
+                grads[instrs[in.a].offset] += g;
+                break;
+            case IrOp::MulScalar:
+                grads[instrs[in.a].offset] += in.value * g;
+                break;
+            case IrOp::PowScalar:
+                grads[instrs[in.a].offset] += in.value * approx_pow(value_of(in.a), in.value - 1, math_mode()) * g;
+                break;
+            case IrOp::Layer:
+            {
+                const float *w = params.data() + in.c;
+                float *dw = param_grads.data() + in.c;
+                float *db = dw + in.a * in.b;
+                const uint32_t *src = args.data() + in.args + in.b;
+                for (uint32_t j = 0; j < in.b; j++)
+                {
+                    float y = values[in.offset + j];
+                    float dz = grads[in.offset + j] * (args[in.args + j] ? 1 - y * y : 1);
+                    for (uint32_t i = 0; i < in.a; i++)
+                    {
+                        dw[j * in.a + i] += dz * value_of(src[i]);
+                        grads[instrs[src[i]].offset] += w[j * in.a + i] * dz;
+                    }
+                    db[j] += dz;
+                }
+                break;
+            }
+            case IrOp::LayerOut:
+                grads[instrs[in.a].offset + in.b] += g;
+                break;
+            }
+        }
+        return param_grads;
+    }
+};
@@ -0,0 +1,636 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <micrograd/nn.hpp>
+
+// Wire format, in host byte order since both ends are on the same machine.
+// Every message is a header followed by `count` 4-byte words of payload: the
+// input or output floats of a Predict, or a ServerStats for Stats.
+enum class MessageType : uint16_t
+{
+    Predict = 0,
+    Stats = 1,
+};
+
+enum class MessageStatus : uint16_t
+{
+    Ok = 0,
+    BadRequest = 1,
+};
+
+struct MessageHeader
+{
+    uint32_t id;
+    uint16_t type_or_status;
+    uint16_t count;
+};
+
+static_assert(sizeof(MessageHeader) == 8);
+
+struct ServerStats
+{
+    uint64_t requests;
+    uint64_t batches;
+    double p50_us;
+    double p99_us;
+    double requests_per_sec;
+};
+
+static_assert(sizeof(ServerStats) % 4 == 0);
+
+bool read_full(int fd, void *buf, size_t size)
+{
+    auto p = static_cast<char *>(buf);
+    while (size > 0)
+    {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool write_full(int fd, const void *buf, size_t size)
+{
+    auto p = static_cast<const char *>(buf);
+    while (size > 0)
+    {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool write_message(int fd, uint32_t id, uint16_t type_or_status, const void *payload, size_t words)
+{
+    if (words > std::numeric_limits<uint16_t>::max())
+    {
+        std::cerr << "message of " << words << " words is too long to send" << std::endl;
+        return false;
+    }
+
+    // One buffer so that the header and payload go out in a single send
+    std::vector<char> buf(sizeof(MessageHeader) + words * 4);
+    MessageHeader header{id, type_or_status, static_cast<uint16_t>(words)};
+    std::memcpy(buf.data(), &header, sizeof(header));
+    if (words > 0)
+    {
+        std::memcpy(buf.data() + sizeof(header), payload, words * 4);
+    }
+    return write_full(fd, buf.data(), buf.size());
+}
+
+sockaddr_un unix_address(const std::string &path)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+// Latency samples of the most recent requests, for percentiles
+struct LatencyWindow
+{
+    std::vector<double> samples;
+    size_t next = 0;
+    size_t capacity;
+
+    LatencyWindow(size_t capacity = 1 << 16) : capacity(capacity) {}
+
+    void add(double us)
+    {
+        if (samples.size() < capacity)
+        {
+            samples.push_back(us);
+        }
+        else
+        {
+            samples[next] = us;
+            next = (next + 1) % capacity;
+        }
+    }
+
+    double percentile(double p) const
+    {
+        if (samples.empty())
+        {
+            return 0;
+        }
+        auto sorted = samples;
+        size_t k = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+        std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        return sorted[k];
+    }
+};
+
+// Serves MLP predictions on a Unix domain socket. Requests from all clients go
+// into one queue; a batching thread takes up to max_batch of them, waiting at
+// most max_wait_us after the oldest one arrived for the batch to fill up, and
+// evaluates them with a single MLP::predict. Each reply is queued as soon as its
+// batch is done and carries the request's id, so a client can keep several
+// requests in flight on one connection. Every connection has its own writer
+// thread, so a client that is slow to read only delays its own replies.
+struct InferenceServer
+{
+    using Clock = std::chrono::steady_clock;
+
+    // Replies queued or pending on one connection before its reader stops
+    // taking requests from it
+    static constexpr size_t max_backlog = 1024;
+
+    struct Connection
+    {
+        struct Reply
+        {
+            uint32_t id;
+            MessageStatus status;
+            std::vector<float> payload;
+        };
+
+        int fd;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<Reply> outbox;
+        // Requests queued for a batch and not replied to yet
+        size_t in_flight = 0;
+        // Set once no more replies are taken: by finish(), by a failed write
+        // and by the server stopping
+        bool closing = false;
+        bool abandoned = false;
+        std::thread writer;
+
+        Connection(int fd) : fd(fd)
+        {
+            writer = std::thread([this]()
+                                 { write_loop(); });
+        }
+
+        ~Connection()
+        {
+            if (writer.joinable())
+            {
+                finish();
+            }
+            close(fd);
+        }
+
+        // Queues a reply for the writer. batched marks the reply to a request
+        // counted by expect(). Returns false if it can't be sent.
+        bool reply(uint32_t id, MessageStatus status, const void *payload, size_t words, bool batched = false)
+        {
+            bool queued = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (batched)
+                {
+                    in_flight--;
+                }
+                if (words > std::numeric_limits<uint16_t>::max())
+                {
+                    std::cerr << "message of " << words << " words is too long to send" << std::endl;
+                }
+                else if (!closing)
+                {
+                    // Copied as bytes: a Stats payload is not floats
+                    outbox.push_back({id, status, std::vector<float>(words)});
+                    if (words > 0)
+                    {
+                        std::memcpy(outbox.back().payload.data(), payload, words * 4);
+                    }
+                    queued = true;
+                }
+            }
+            cv.notify_all();
+            return queued;
+        }
+
+        // Counts a request about to be queued for a batch. Waits while the
+        // client has max_backlog replies it hasn't read or that are pending.
+        // Returns false if the server stopped.
+        bool expect()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]()
+                    { return abandoned || in_flight + outbox.size() < max_backlog; });
+            if (abandoned)
+            {
+                return false;
+            }
+            in_flight++;
+            return true;
+        }
+
+        // Called by the server stopping: nothing pending will be replied to
+        void abandon()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                abandoned = true;
+            }
+            cv.notify_all();
+        }
+
+        // Waits for the replies to the requests read so far to be written,
+        // then stops the writer
+        void finish()
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]()
+                        { return abandoned || in_flight == 0; });
+                closing = true;
+            }
+            cv.notify_all();
+            writer.join();
+        }
+
+        void write_loop()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                cv.wait(lock, [this]()
+                        { return closing || !outbox.empty(); });
+                if (outbox.empty())
+                {
+                    return;
+                }
+                auto reply = std::move(outbox.front());
+                outbox.pop_front();
+                lock.unlock();
+                bool ok = write_message(fd, reply.id, static_cast<uint16_t>(reply.status), reply.payload.data(), reply.payload.size());
+                lock.lock();
+                if (!ok)
+                {
+                    // The client is gone; drop what is left and what comes
+                    closing = true;
+                    outbox.clear();
+                }
+                // expect() and finish() wait for the outbox to drain
+                cv.notify_all();
+            }
+        }
+    };
+
+    // A thread reading one connection, joined once it is done
+    struct Reader
+    {
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+
+    struct Pending
+    {
+        std::shared_ptr<Connection> conn;
+        uint32_t id;
+        std::vector<float> input;
+        Clock::time_point arrival;
+    };
+
+    MLP &model;
+    std::string path;
+    size_t nin;
+    size_t max_batch;
+    std::chrono::microseconds max_wait;
+
+    int listen_fd = -1;
+    std::atomic<bool> stopping{false};
+    std::thread accept_thread;
+    std::thread batch_thread;
+
+    std::mutex connections_mutex;
+    std::vector<std::weak_ptr<Connection>> connections;
+    std::list<Reader> readers;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::deque<Pending> queue;
+
+    std::mutex stats_mutex;
+    LatencyWindow latencies;
+    uint64_t requests = 0;
+    uint64_t batches = 0;
+    Clock::time_point started = Clock::now();
+
+    InferenceServer(MLP &model, const std::string &path, size_t max_batch = 32, size_t max_wait_us = 200)
+        : model(model), path(path), nin(model.layers.front().neurons.front().w.size()),
+          max_batch(max_batch), max_wait(max_wait_us)
+    {
+    }
+
+    InferenceServer(const InferenceServer &) = delete;
+    InferenceServer &operator=(const InferenceServer &) = delete;
+
+    ~InferenceServer()
+    {
+        stop();
+    }
+
+    bool start()
+    {
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0)
+        {
+            std::cerr << "socket failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+
+        unlink(path.c_str());
+        auto addr = unix_address(path);
+        if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(listen_fd, 64) != 0)
+        {
+            std::cerr << "bind/listen on " << path << " failed: " << std::strerror(errno) << std::endl;
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+
+        started = Clock::now();
+        accept_thread = std::thread([this]()
+                                    { accept_loop(); });
+        batch_thread = std::thread([this, mode = math_mode()]()
+                                   {
+            ScopedMathMode scope(mode);
+            batch_loop(); });
+        return true;
+    }
+
+    void stop()
+    {
+        if (listen_fd < 0 || stopping.exchange(true))
+        {
+            return;
+        }
+
+        // Wakes accept() and every blocked recv()
+        shutdown(listen_fd, SHUT_RDWR);
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            for (auto &weak : connections)
+            {
+                if (auto conn = weak.lock())
+                {
+                    shutdown(conn->fd, SHUT_RDWR);
+                    conn->abandon();
+                }
+            }
+        }
+        {
+            // Taking the lock orders the store to `stopping` before the
+            // batching thread's next check of its wait condition
+            std::lock_guard<std::mutex> lock(queue_mutex);
+        }
+        queue_cv.notify_all();
+
+        accept_thread.join();
+        batch_thread.join();
+        for (auto &reader : readers)
+        {
+            reader.thread.join();
+        }
+        close(listen_fd);
+        unlink(path.c_str());
+    }
+
+    ServerStats stats()
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        double seconds = std::chrono::duration<double>(Clock::now() - started).count();
+        return {requests, batches, latencies.percentile(0.50), latencies.percentile(0.99),
+                seconds > 0 ? requests / seconds : 0};
+    }
+
+    void accept_loop()
+    {
+        while (!stopping)
+        {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return;
+            }
+
+            auto conn = std::make_shared<Connection>(fd);
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            if (stopping)
+            {
+                return;
+            }
+            std::erase_if(connections, [](const std::weak_ptr<Connection> &c)
+                          { return c.expired(); });
+            // Join the readers of connections that have closed, so that their
+            // threads don't pile up on a long running server
+            std::erase_if(readers, [](Reader &reader)
+                          {
+                if (!reader.done)
+                {
+                    return false;
+                }
+                reader.thread.join();
+                return true; });
+            connections.push_back(conn);
+            auto &reader = readers.emplace_back();
+            reader.thread = std::thread([this, conn, &reader]()
+                                        {
+                read_loop(conn);
+                conn->finish();
+                reader.done = true; });
+        }
+    }
+
+    void read_loop(std::shared_ptr<Connection> conn)
+    {
+        MessageHeader header;
+        while (!stopping && read_full(conn->fd, &header, sizeof(header)))
+        {
+            std::vector<float> payload(header.count);
+            if (!read_full(conn->fd, payload.data(), payload.size() * 4))
+            {
+                return;
+            }
+
+            auto type = static_cast<MessageType>(header.type_or_status);
+            if (type == MessageType::Stats)
+            {
+                auto s = stats();
+                conn->reply(header.id, MessageStatus::Ok, &s, sizeof(s) / 4);
+            }
+            else if (type == MessageType::Predict && payload.size() == nin)
+            {
+                if (!conn->expect())
+                {
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex);
+                    queue.push_back({conn, header.id, std::move(payload), Clock::now()});
+                }
+                queue_cv.notify_one();
+            }
+            else
+            {
+                conn->reply(header.id, MessageStatus::BadRequest, nullptr, 0);
+            }
+        }
+    }
+
+    void batch_loop()
+    {
+        while (true)
+        {
+            std::vector<Pending> batch;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_cv.wait(lock, [this]()
+                              { return stopping || !queue.empty(); });
+                if (stopping)
+                {
+                    return;
+                }
+
+                // Give the batch until max_wait after its oldest request to fill
+                auto deadline = queue.front().arrival + max_wait;
+                queue_cv.wait_until(lock, deadline, [this]()
+                                    { return stopping || queue.size() >= max_batch; });
+
+                size_t n = std::min(queue.size(), max_batch);
+                batch.reserve(n);
+                for (size_t i = 0; i < n; i++)
+                {
+                    batch.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                }
+            }
+
+            std::vector<std::vector<float>> xs;
+            xs.reserve(batch.size());
+            for (auto &p : batch)
+            {
+                xs.push_back(std::move(p.input));
+            }
+            auto ys = model.predict(xs);
+
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                batch[i].conn->reply(batch[i].id, MessageStatus::Ok, ys[i].data(), ys[i].size(), true);
+            }
+
+            auto now = Clock::now();
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            for (auto &p : batch)
+            {
+                latencies.add(std::chrono::duration<double, std::micro>(now - p.arrival).count());
+            }
+            requests += batch.size();
+            batches++;
+        }
+    }
+};
+
+// Blocking client for InferenceServer. send() and receive() can be used
+// separately to keep several requests in flight on the one connection.
+struct InferenceClient
+{
+    int fd = -1;
+
+    InferenceClient(const std::string &path)
+    {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        auto addr = unix_address(path);
+        if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+        {
+            std::cerr << "connect to " << path << " failed: " << std::strerror(errno) << std::endl;
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    InferenceClient(const InferenceClient &) = delete;
+    InferenceClient &operator=(const InferenceClient &) = delete;
+
+    ~InferenceClient()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    bool ok() const { return fd >= 0; }
+
+    bool send(uint32_t id, const std::vector<float> &x)
+    {
+        return write_message(fd, id, static_cast<uint16_t>(MessageType::Predict), x.data(), x.size());
+    }
+
+    // Reads the next reply, which may belong to any request in flight
+    bool receive(uint32_t &id, std::vector<float> &y)
+    {
+        MessageHeader header;
+        if (!read_full(fd, &header, sizeof(header)))
+        {
+            return false;
+        }
+        id = header.id;
+        y.resize(header.count);
+        return read_full(fd, y.data(), y.size() * 4) &&
+               static_cast<MessageStatus>(header.type_or_status) == MessageStatus::Ok;
+    }
+
+    bool predict(const std::vector<float> &x, std::vector<float> &y)
+    {
+        uint32_t id;
+        return send(0, x) && receive(id, y);
+    }
+
+    bool stats(ServerStats &out)
+    {
+        MessageHeader header;
+        if (!write_message(fd, 0, static_cast<uint16_t>(MessageType::Stats), nullptr, 0) ||
+            !read_full(fd, &header, sizeof(header)) || header.count * 4 != sizeof(ServerStats))
+        {
+            return false;
+        }
+        return read_full(fd, &out, sizeof(out));
+    }
+};
@@ -0,0 +1,92 @@
+#include <csignal>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <micrograd/nn.hpp>
+#include <micrograd/serve.hpp>
+
+std::atomic<bool> interrupted{false};
+
+void usage(const char *argv0)
+{
+    std::cerr << "Usage: " << argv0 << " SOCKET [--max-batch N] [--max-wait-us US] [--shape NIN,NOUT,...]\n"
+              << "  --max-batch N      largest batch evaluated at once (default 32)\n"
+              << "  --max-wait-us US   longest a request waits for its batch to fill (default 200)\n"
+              << "  --shape SIZES      MLP layer sizes, starting with the input (default 3,4,4,1)\n";
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::string path = argv[1];
+    size_t max_batch = 32;
+    size_t max_wait_us = 200;
+    std::vector<size_t> shape = {3, 4, 4, 1};
+
+    for (int i = 2; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--max-batch" && i + 1 < argc)
+        {
+            max_batch = std::stoul(argv[++i]);
+        }
+        else if (arg == "--max-wait-us" && i + 1 < argc)
+        {
+            max_wait_us = std::stoul(argv[++i]);
+        }
+        else if (arg == "--shape" && i + 1 < argc)
+        {
+            shape.clear();
+            std::stringstream ss(argv[++i]);
+            std::string size;
+            while (std::getline(ss, size, ','))
+            {
+                shape.push_back(std::stoul(size));
+            }
+        }
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (shape.size() < 2)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    auto model = MLP(shape.front(), std::vector<size_t>(shape.begin() + 1, shape.end()));
+    auto server = InferenceServer(model, path, max_batch, max_wait_us);
+    if (!server.start())
+    {
+        return 1;
+    }
+
+    std::signal(SIGINT, [](int)
+                { interrupted = true; });
+    std::signal(SIGTERM, [](int)
+                { interrupted = true; });
+
+    std::cerr << "Serving MLP with " << model.parameters().size() << " parameters on " << path << std::endl;
+
+    while (!interrupted)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        auto s = server.stats();
+        std::cerr << "requests " << s.requests << " batches " << s.batches
+                  << " p50 " << s.p50_us << "us p99 " << s.p99_us << "us "
+                  << s.requests_per_sec << " req/s" << std::endl;
+    }
+
+    server.stop();
+    return 0;
+}
@@ -1,12 +1,19 @@
 #include <iostream>
 #include <iomanip>
 
+#include <micrograd/distributed.hpp>
 #include <micrograd/engine.hpp>
+#include <micrograd/expr.hpp>
+#include <micrograd/grad.hpp>
+#include <micrograd/incremental.hpp>
+#include <micrograd/ir.hpp>
+#include <micrograd/memory.hpp>
 #include <micrograd/nn.hpp>
+#include <micrograd/pipeline.hpp>
+#include <micrograd/serve.hpp>
 
-void is_close_helper(float a, float b, const char *file, const int line)
+void is_close_helper(float a, float b, const char *file, const int line, float epsilon = 1e-6)
 {
-    float epsilon = 1e-6;
     float hi = b + epsilon;
     float lo = b - epsilon;
 
@@ -43,6 +50,7 @@ void not_equal_helper(const T &a, const T &b, const char *file, const int line)
 }
 
 #define is_close(a, b) is_close_helper(a, b, __FILE__, __LINE__)
+#define is_close_eps(a, b, eps) is_close_helper(a, b, __FILE__, __LINE__, eps)
 #define is_equal(a, b) is_equal_helper(a, b, __FILE__, __LINE__)
 #define not_equal(a, b) not_equal_helper(a, b, __FILE__, __LINE__)
 
@@ -72,6 +80,9 @@ void test_add()
     auto b = Value(5.0, "b");
     auto c = a + b;
     c.label() = "c";
+    is_equal(a.ctx_, c.ctx_->prev[0]);
+    is_equal(b.ctx_, c.ctx_->prev[1]);
+
     c.backward();
 
     is_close(a.grad(), 1.0);
@@ -79,8 +90,8 @@ void test_add()
     is_close(c.data(), 3.0);
     is_close(c.grad(), 1.0);
 
-    is_equal(a.ctx_, c.ctx_->prev[0]);
-    is_equal(b.ctx_, c.ctx_->prev[1]);
+    // backward() released the graph
+    is_equal(c.ctx_->prev.size(), size_t(0));
 }
 
 void test_plus_equal()
@@ -249,6 +260,348 @@ void test_pow()
     }
 }
 
+// Distance between two floats in units in the last place
+int64_t ulps(float a, float b)
+{
+    auto ordered = [](float f)
+    {
+        int32_t bits = std::bit_cast<int32_t>(f);
+        return bits < 0 ? -int64_t(bits & 0x7fffffff) : int64_t(bits);
+    };
+    return std::abs(ordered(a) - ordered(b));
+}
+
+void test_approx()
+{
+    struct Function
+    {
+        float (*approx)(float, MathMode);
+        void (*array)(const float *, float *, size_t, MathMode);
+        double (*reference)(double);
+        float lo;
+        float hi;
+    };
+    std::vector<Function> functions = {
+        {approx_tanh, approx_tanh, [](double x) { return std::tanh(x); }, -20, 20},
+        {approx_exp, approx_exp, [](double x) { return std::exp(x); }, -87, 88},
+        {approx_log, approx_log, [](double x) { return std::log(x); }, 1e-30f, 1e6f},
+        {approx_sigmoid, approx_sigmoid, [](double x) { return 1 / (1 + std::exp(-x)); }, -40, 40},
+    };
+    // The documented max errors of tanh, exp, log and sigmoid in each mode
+    std::vector<std::pair<MathMode, std::vector<int64_t>>> bounds = {
+        {MathMode::Exact, {2, 1, 1, 2}},
+        {MathMode::Fast, {1, 1, 1, 2}},
+        {MathMode::UltraFast, {3134, 1266, 8703, 1267}},
+    };
+
+    const size_t n = 100001;
+    std::vector<float> x(n);
+    std::vector<float> y(n);
+    for (auto &[mode, bound] : bounds)
+    {
+        for (size_t f = 0; f < functions.size(); f++)
+        {
+            auto &fn = functions[f];
+            for (size_t i = 0; i < n; i++)
+            {
+                float t = float(i) / (n - 1);
+                // log is swept in log space
+                x[i] = f == 2 ? fn.lo * std::pow(fn.hi / fn.lo, t) : fn.lo + (fn.hi - fn.lo) * t;
+            }
+            fn.array(x.data(), y.data(), n, mode);
+
+            int64_t worst = 0;
+            for (size_t i = 0; i < n; i++)
+            {
+                float ref = float(fn.reference(x[i]));
+                worst = std::max(worst, ulps(fn.approx(x[i], mode), ref));
+                is_equal(y[i], fn.approx(x[i], mode));
+            }
+            is_equal(worst <= bound[f], true);
+        }
+    }
+
+    // The edges
+    float inf = std::numeric_limits<float>::infinity();
+    for (auto mode : {MathMode::Fast, MathMode::UltraFast})
+    {
+        is_equal(approx_exp(inf, mode), inf);
+        is_equal(approx_exp(100.0f, mode), inf);
+        is_equal(approx_exp(-inf, mode), 0.0f);
+        is_equal(std::isnan(approx_exp(NAN, mode)), true);
+        is_equal(approx_log(inf, mode), inf);
+        is_equal(approx_log(0.0f, mode), -inf);
+        is_equal(std::isnan(approx_log(-1.0f, mode)), true);
+        is_close_eps(approx_log(1e-40f, mode), std::log(1e-40f), 1e-3);
+        is_equal(approx_tanh(inf, mode), 1.0f);
+        is_equal(approx_tanh(-50.0f, mode), -1.0f);
+        is_equal(approx_tanh(0.0f, mode), 0.0f);
+        is_equal(approx_sigmoid(-inf, mode), 0.0f);
+        is_equal(approx_pow(-2.0f, 3.0f, mode), -8.0f);
+        is_equal(approx_pow(0.0f, 0.0f, mode), 1.0f);
+        is_close_eps(approx_pow(2.0f, 0.5f, mode), std::sqrt(2.0f), 1e-3);
+    }
+
+    // The engine's ops follow math_mode(), forward and backward
+    {
+        ScopedMathMode scope(MathMode::Fast);
+        for (float v = -3; v <= 3; v += 0.25)
+        {
+            auto a = Value(v);
+            auto b = a.tanh();
+            is_close(b.data(), std::tanh(v));
+            is_equal(b.data(), approx_tanh(v, MathMode::Fast));
+            b.backward();
+            is_equal(a.grad(), 1 - b.data() * b.data());
+
+            auto c = Value(v);
+            auto d = c.exp();
+            is_equal(d.data(), approx_exp(v, MathMode::Fast));
+            d.backward();
+            is_equal(c.grad(), d.data());
+        }
+
+        auto a = Value(1.5f);
+        auto p = Value(2.5f);
+        auto b = a.pow(p);
+        is_close_eps(b.data(), std::pow(1.5f, 2.5f), 1e-5);
+        b.backward();
+        is_close_eps(a.grad(), 2.5f * std::pow(1.5f, 1.5f), 1e-5);
+        is_close_eps(p.grad(), std::pow(1.5f, 2.5f) * std::log(1.5f), 1e-5);
+
+#ifdef MICROGRAD_LAZY
+        // The batch kernels of lazy evaluation agree with the eager ops
+        std::vector<Value> eager;
+        std::vector<Value> batched;
+        for (float v = -3; v <= 3; v += 0.25)
+        {
+            eager.push_back((Value(v) * 2.0f).tanh().exp());
+        }
+        {
+            ScopedLazyEvaluation lazy;
+            for (float v = -3; v <= 3; v += 0.25)
+            {
+                batched.push_back((Value(v) * 2.0f).tanh().exp());
+            }
+        }
+        for (size_t i = 0; i < eager.size(); i++)
+        {
+            is_equal(batched[i].data(), eager[i].data());
+        }
+#endif
+    }
+
+    // A network in UltraFast mode stays within its error of the exact one
+    auto net = MLP(4, {8, 8, 1}, Initializer(Init::Xavier, 3));
+    std::vector<Value> in = {Value(0.5f), Value(-1.0f), Value(0.25f), Value(2.0f)};
+    float exact = net(in)[0].data();
+    {
+        ScopedMathMode scope(MathMode::UltraFast);
+        is_close_eps(net(in)[0].data(), exact, 1e-3);
+        auto y = net.predict(std::vector<std::vector<float>>{{0.5f, -1.0f, 0.25f, 2.0f}});
+        is_close_eps(y[0][0], exact, 1e-3);
+    }
+
+#ifdef MICROGRAD_LAZY
+    // Lazy nodes run in the mode they were recorded in
+    {
+        std::vector<Value> lazy;
+        {
+            // Evaluated at the end of the outer scope, back in Exact
+            ScopedLazyEvaluation recording;
+            {
+                ScopedMathMode scope(MathMode::UltraFast);
+                for (float v = -3; v <= 3; v += 0.25)
+                {
+                    lazy.push_back((Value(v) * 1.0f).tanh());
+                }
+            }
+            is_equal(math_mode() == MathMode::Exact, true);
+        }
+        size_t i = 0;
+        for (float v = -3; v <= 3; v += 0.25)
+        {
+            is_equal(lazy[i++].data(), approx_tanh(v, MathMode::UltraFast));
+        }
+    }
+#endif
+
+    // The mode is per thread. The workers of a parallel backward run in the
+    // caller's.
+    {
+        ScopedMathMode scope(MathMode::UltraFast);
+        auto other = std::thread([]()
+                                 { is_equal(math_mode() == MathMode::Exact, true); });
+        other.join();
+
+        std::vector<Value> sequential;
+        std::vector<Value> parallel;
+        for (int k = 0; k < 2; k++)
+        {
+            auto &xs = k == 0 ? sequential : parallel;
+            Value sum = Value(0.0f);
+            for (int j = 0; j < 256; j++)
+            {
+                xs.push_back(Value(1.0f + j / 256.0f));
+                sum = sum + xs.back().pow(Value(2.5f));
+            }
+            sum.backward(k == 0 ? 1 : 4);
+        }
+        for (size_t j = 0; j < sequential.size(); j++)
+        {
+            is_equal(parallel[j].grad(), sequential[j].grad());
+        }
+        not_equal(sequential[100].grad(), 2.5f * std::pow(sequential[100].data(), 1.5f));
+    }
+}
+
+void test_native_ops()
+{
+    // Each op is a single node over its operands
+    auto a = Value(3.0f, "a");
+    auto b = Value(-2.0f, "b");
+
+    auto c = a - b;
+    is_equal(c.op(), "-");
+    is_equal(c.ctx_->prev.size(), size_t(2));
+    is_close(c.data(), 5.0f);
+
+    auto d = a / b;
+    is_equal(d.op(), "/");
+    is_close(d.data(), -1.5f);
+    d.backward();
+    is_close(a.grad(), -0.5f);
+    is_close(b.grad(), -3.0f / 4.0f);
+
+    a.grad() = 0;
+    auto n = -a;
+    is_equal(n.op(), "neg");
+    n.backward();
+    is_close(n.data(), -3.0f);
+    is_close(a.grad(), -1.0f);
+
+    a.grad() = 0;
+    auto sq = a.square();
+    sq.backward();
+    is_close(sq.data(), 9.0f);
+    is_close(a.grad(), 6.0f);
+
+    a.grad() = 0;
+    auto r = a.reciprocal();
+    r.backward();
+    is_close(r.data(), 1.0f / 3.0f);
+    is_close(a.grad(), -1.0f / 9.0f);
+
+    a.grad() = 0;
+    auto l = a.log();
+    l.backward();
+    is_close(l.data(), std::log(3.0f));
+    is_close(a.grad(), 1.0f / 3.0f);
+
+    // Scalar operands don't get a node of their own
+    a.grad() = 0;
+    float four = 4, one = 1, two = 2;
+    auto s = a * four;
+    is_equal(s.op(), "*c");
+    is_equal(s.ctx_->prev.size(), size_t(1));
+    auto t = s - one;
+    auto u = t.pow(two);
+    auto v = u / two;
+    is_close(v.data(), 60.5f);
+    v.backward();
+    // d/da (4a - 1)^2 / 2 = 4 (4a - 1)
+    is_close(a.grad(), 44.0f);
+
+    // pow propagates to the exponent: d/dp x^p = x^p ln(x)
+    auto x = Value(2.0f);
+    auto p = Value(3.0f);
+    auto y = x.pow(p);
+    y.backward();
+    is_close(x.grad(), 12.0f);
+    is_close_eps(p.grad(), 8.0f * std::log(2.0f), 1e-5);
+}
+
+void test_fused()
+{
+    auto a = Value(0.5f);
+    auto b = Value(-1.5f);
+    auto c = Value(2.0f);
+
+    // (a * b + c).tanh() as one node
+    Value y = (expr(a) * b + c).tanh();
+    is_equal(y.op(), "fused");
+    is_equal(y.ctx_->prev.size(), size_t(3));
+    y.backward();
+    float ga = a.grad(), gb = b.grad(), gc = c.grad();
+
+    a.grad() = b.grad() = c.grad() = 0;
+    auto ab = a * b;
+    auto ref = (ab + c).tanh();
+    is_close(y.data(), ref.data());
+    ref.backward();
+    is_close(ga, a.grad());
+    is_close(gb, b.grad());
+    is_close(gc, c.grad());
+
+    // Repeated leaves, floats, division and the unary ops
+    a.grad() = b.grad() = 0;
+    Value z = fuse(((expr(a) * a - a / b) * 2.0f).exp() + (1.0f - expr(b)).square() - expr(a).pow(3).reciprocal());
+    z.backward();
+    ga = a.grad();
+    gb = b.grad();
+
+    a.grad() = b.grad() = 0;
+    float two = 2, one = 1, three = 3;
+    auto aa = a * a;
+    auto adb = a / b;
+    auto diff = aa - adb;
+    auto e = (diff * two).exp();
+    auto omb = -b;
+    auto sq = (omb + one).square();
+    auto r = a.pow(three).reciprocal();
+    auto es = e + sq;
+    auto zref = es - r;
+    is_close(z.data(), zref.data());
+    zref.backward();
+    is_close_eps(ga, a.grad(), 1e-4);
+    is_close_eps(gb, b.grad(), 1e-4);
+
+    // Constants fold
+    auto k = Value::constant(3.0f);
+    Value w = expr(k) * k;
+    is_equal(w.requires_grad(), false);
+    is_close(w.data(), 9.0f);
+}
+
+void test_value_ownership()
+{
+    // Operands can be const and temporaries, and floats stay floats
+    const Value a(2.0f);
+    auto b = a * 3.0f + a / 2.0f - 1.0f;
+    auto c = (a + a) * (a - 1.0f);
+    is_close(b.data(), 6.0f);
+    is_close(c.data(), 4.0f);
+
+    // A graph is freed with its last Value
+    std::weak_ptr<Context> inner;
+    {
+        auto x = Value(0.5f);
+        auto y = (x * x).tanh();
+        inner = y.ctx_->prev[0];
+        y.backward();
+    }
+    is_equal(inner.expired(), true);
+
+    // Without recursing once per node
+    auto x = Value(1.0f);
+    auto chain = x * 1.0f;
+    for (size_t i = 0; i < 1000000; i++)
+    {
+        chain = chain + 1.0f;
+    }
+    is_close(chain.data(), 1000001.0f);
+}
+
 void test_dot()
 {
     size_t size = 10;
@@ -312,6 +665,32 @@ void test_expr()
     is_close(L.grad(), 1);
 }
 
+void test_requires_grad()
+{
+    auto a = Value(3.0, "a");
+    auto k = Value::constant(2.0);
+    is_equal(a.requires_grad(), true);
+    is_equal(k.requires_grad(), false);
+
+    // Constant subexpressions are folded into a single leaf
+    auto one = Value::constant(1.0);
+    auto folded = (k * k + one).tanh();
+    is_equal(folded.requires_grad(), false);
+    is_equal(folded.ctx_->prev.size(), size_t(0));
+    is_close(folded.data(), std::tanh(5.0f));
+
+    auto c = a * folded - one;
+    is_equal(c.requires_grad(), true);
+    c.backward();
+
+    is_close(a.grad(), std::tanh(5.0f));
+    is_close(k.grad(), 0.0);
+    is_close(folded.grad(), 0.0);
+
+    auto xs = to_values(std::vector<float>{1.0f, 2.0f});
+    is_equal(xs[0].requires_grad(), false);
+}
+
 void test_neuron()
 {
     size_t nin = 10;
@@ -355,6 +734,225 @@ void test_layer()
     is_equal(y.size(), nout);
 }
 
+void test_layer_backward()
+{
+    // The fused layer node must give the same gradients as per-neuron graphs
+    size_t nin = 20;
+    size_t nout = 5;
+    auto layer = Layer(nin, nout, true, Initializer(Init::Uniform, 7));
+    layer.neurons[1].nonlin = false;
+
+    std::vector<Value> x;
+    for (size_t i = 0; i < nin; i++)
+    {
+        x.push_back(Value(0.1f * i - 1.0f));
+    }
+
+    auto y = layer(x);
+    auto loss = Value::constant(0.0);
+    for (size_t j = 0; j < nout; j++)
+    {
+        float scale = j + 1;
+        loss += y[j] * scale;
+    }
+    layer.zero_grad();
+    loss.backward();
+
+    std::vector<float> layer_grads;
+    for (auto &p : layer.parameters())
+    {
+        layer_grads.push_back(p.grad());
+    }
+    std::vector<float> x_grads;
+    for (auto &v : x)
+    {
+        x_grads.push_back(v.grad());
+        v.grad() = 0;
+    }
+
+    auto ref = Value::constant(0.0);
+    for (size_t j = 0; j < nout; j++)
+    {
+        auto yj = layer.neurons[j](x);
+        is_close_eps(yj.data(), y[j].data(), 1e-5);
+        float scale = j + 1;
+        ref += yj * scale;
+    }
+    layer.zero_grad();
+    ref.backward();
+
+    auto params = layer.parameters();
+    for (size_t k = 0; k < params.size(); k++)
+    {
+        is_close_eps(layer_grads[k], params[k].grad(), 1e-5);
+    }
+    for (size_t i = 0; i < nin; i++)
+    {
+        is_close_eps(x_grads[i], x[i].grad(), 1e-5);
+    }
+
+    // Weights are views into the layer's matrix
+    layer.neurons[2].w[3].data() = 0.5f;
+    is_close(layer.block->weight[2 * layer.block->ld + 3], 0.5f);
+}
+
+void test_ir()
+{
+    auto n = MLP(3, {4, 4, 1}, Initializer(Init::Uniform, 3));
+    Value a(0.3f);
+    Value two = Value::constant(2.0f);
+
+    auto build = [&](std::vector<Value> &x)
+    {
+        auto y = n(x);
+        auto e = (a * two).exp();
+        auto p = a.pow(two);
+        auto px = p * x[1];
+        auto q = (e - px) / a;
+        float half = 0.5f;
+        auto r = (q * half).square() + e.reciprocal();
+        auto s = -r;
+        return std::vector<Value>{y[0], s};
+    };
+
+    auto x = trace_inputs({2.0f, 3.0f, -1.0f});
+    auto outputs = build(x);
+    IrGraph graph;
+    is_equal(trace_ir(outputs, x, graph), true);
+    is_equal(graph.params.size(), n.parameters().size() + 1);
+
+    IrProgram program;
+    is_equal(program.parse(graph.bytes.data(), graph.bytes.size()), true);
+    is_equal(program.num_inputs, 3u);
+    is_equal(program.outputs.size(), size_t(2));
+
+    // Same results as the engine on an input the graph was not traced with
+    std::vector<float> x2 = {0.5f, -1.0f, 1.5f};
+    auto xv = to_values(x2);
+    auto expected = build(xv);
+    auto y = program.forward(x2);
+    is_close_eps(y[0], expected[0].data(), 1e-5);
+    is_close_eps(y[1], expected[1].data(), 1e-5);
+
+    n.zero_grad();
+    a.grad() = 0;
+    backward(expected, {1.0f, 0.5f});
+    auto &grads = program.backward({1.0f, 0.5f});
+    for (size_t k = 0; k < graph.params.size(); k++)
+    {
+        is_close_eps(grads[k], graph.params[k].grad(), 1e-5);
+    }
+
+    // Ops on the inputs alone, ahead of the layers, follow a new input too
+    auto scaled = [&](std::vector<Value> &x)
+    {
+        float half = 0.5f;
+        std::vector<Value> h = {x[0] * x[1], x[1] * half, x[2]};
+        return n(h);
+    };
+    auto xs = trace_inputs({2.0f, 3.0f, -1.0f});
+    IrGraph scaled_graph;
+    is_equal(trace_ir(scaled(xs), xs, scaled_graph), true);
+    IrProgram scaled_program;
+    is_equal(scaled_program.parse(scaled_graph.bytes.data(), scaled_graph.bytes.size()), true);
+    is_close_eps(scaled_program.forward(x2)[0], scaled(xv)[0].data(), 1e-5);
+
+    // Constant inputs would bake those ops in as constants
+    auto cx = to_values(std::vector<float>{2.0f, 3.0f, -1.0f});
+    is_equal(trace_ir(scaled(cx), cx, scaled_graph), false);
+
+    // Wrong numbers of inputs or output gradients
+    is_equal(program.forward({1.0f}).empty(), true);
+    is_close(program.backward({1.0f})[0], 0.0f);
+
+    // Truncated or corrupt files are rejected
+    is_equal(program.parse(graph.bytes.data(), graph.bytes.size() - 1), false);
+    auto bad = graph.bytes;
+    bad[0] = 'X';
+    is_equal(program.parse(bad.data(), bad.size()), false);
+    bad = graph.bytes;
+    uint32_t old_version = 1;
+    std::memcpy(bad.data() + 4, &old_version, 4);
+    is_equal(program.parse(bad.data(), bad.size()), false);
+}
+
+void test_embedding()
+{
+    auto emb = Embedding(10, 3, Initializer(Init::Uniform, 5));
+    auto before = emb.table->weight;
+
+    auto e = emb({2, 5, 2});
+    is_equal(e.size(), size_t(9));
+    is_close(e[4].data(), before[5 * 3 + 1]);
+    is_close(e[6].data(), before[2 * 3]);
+
+    auto loss = Value::constant(0.0);
+    for (size_t i = 0; i < e.size(); i++)
+    {
+        float scale = i + 1;
+        loss += e[i] * scale;
+    }
+    loss.backward();
+
+    // Row 2 was read twice, row 5 once, nothing else
+    auto &g = emb.table->weight_grad;
+    is_close(g[2 * 3 + 0], 1.0f + 7.0f);
+    is_close(g[2 * 3 + 2], 3.0f + 9.0f);
+    is_close(g[5 * 3 + 1], 5.0f);
+    is_equal(emb.table->touched_rows.size(), size_t(2));
+    for (size_t row : {0, 1, 3, 4, 6, 7, 8, 9})
+    {
+        for (size_t k = 0; k < 3; k++)
+        {
+            is_close(g[row * 3 + k], 0.0f);
+        }
+    }
+
+    emb.update(0.1);
+    auto &w = emb.table->weight;
+    is_close(w[2 * 3 + 0], before[2 * 3 + 0] - 0.8f);
+    is_close(w[5 * 3 + 1], before[5 * 3 + 1] - 0.5f);
+    is_close(w[7 * 3 + 1], before[7 * 3 + 1]);
+    is_close(g[2 * 3 + 0], 0.0f);
+    is_equal(emb.table->touched_rows.size(), size_t(0));
+
+    // Dense views share the table
+    auto params = emb.parameters();
+    is_equal(params.size(), size_t(30));
+    is_close(params[5 * 3 + 1].data(), w[5 * 3 + 1]);
+
+    // A gradient that reaches a row through them is applied and cleared too,
+    // on every step
+    for (int step = 0; step < 2; step++)
+    {
+        float w7 = w[7 * 3];
+        (params[7 * 3] * 2.0f).backward();
+        is_close(g[7 * 3], 2.0f);
+        emb.update(0.1);
+        is_close(w[7 * 3], w7 - 0.2f);
+        is_close(g[7 * 3], 0.0f);
+    }
+    (params[8 * 3] * 2.0f).backward();
+    emb.zero_grad();
+    is_close(g[8 * 3], 0.0f);
+    is_equal(emb.table->touched_rows.size(), size_t(10));
+
+    // The entries' Contexts are built once, whichever thread asks first
+    auto shared = Embedding(100, 4, Initializer(Init::Uniform, 5));
+    std::vector<std::vector<Value>> views(4);
+    parallel_for(views.size(), [&](size_t t)
+                 { views[t] = shared.parameters(); });
+    for (size_t t = 1; t < views.size(); t++)
+    {
+        is_equal(views[t][123].ctx_.get(), views[0][123].ctx_.get());
+    }
+
+    emb.freeze();
+    auto f = emb(std::vector<size_t>{1});
+    is_equal(f[0].requires_grad(), false);
+    is_equal(emb.trainable_parameters().size(), size_t(0));
+}
+
 void test_mlp()
 {
     std::vector<float> x = {2.0f, 3.0f, -1.0f};
@@ -362,6 +960,974 @@ void test_mlp()
     auto o = n(x);
 }
 
+#ifdef MICROGRAD_LAZY
+void test_lazy()
+{
+    std::vector<Neuron> neurons;
+    for (size_t j = 0; j < 4; j++)
+    {
+        neurons.push_back(Neuron(3, true, Initializer(Init::He, 5), j * 4, 3));
+    }
+    std::vector<std::vector<float>> xs = {{2.0f, 3.0f, -1.0f}, {0.5f, -1.0f, 1.0f}};
+
+    auto loss_of = [&]()
+    {
+        Value loss = 0;
+        for (auto &x : xs)
+        {
+            for (auto &n : neurons)
+            {
+                loss += (n(x) - 0.5f).square() / 2.0f;
+            }
+        }
+        return loss;
+    };
+
+    auto expected = loss_of();
+    expected.backward();
+    std::vector<float> expected_grads;
+    for (auto &n : neurons)
+    {
+        for (auto &p : n.parameters())
+        {
+            expected_grads.push_back(p.grad());
+            p.grad() = 0;
+        }
+    }
+
+    {
+        ScopedLazyEvaluation lazy;
+        auto loss = loss_of();
+        // Recorded, not computed, until the data is read
+        is_equal(lazy_record().empty(), false);
+        is_close(loss.data(), expected.data());
+        is_equal(lazy_record().empty(), true);
+
+        // backward() evaluates what it needs
+        loss = loss_of();
+        loss.backward();
+        size_t k = 0;
+        for (auto &n : neurons)
+        {
+            for (auto &p : n.parameters())
+            {
+                is_close(p.grad(), expected_grads[k++]);
+            }
+        }
+
+        // So does a Layer reading its inputs
+        auto a = Value(0.3f, "a");
+        std::vector<Value> x = {a.tanh(), a * 2.0f, a.exp()};
+        auto y = Layer(3, 2, true, Initializer(Init::He, 9))(x);
+        auto ref = Layer(3, 2, true, Initializer(Init::He, 9))(std::vector<Value>{Value(std::tanh(0.3f)), Value(0.6f), Value(std::exp(0.3f))});
+        is_close(y[1].data(), ref[1].data());
+
+        auto pending = a.tanh();
+        is_equal(lazy_record().size, size_t(1));
+    }
+    // The end of the scope evaluated it
+    is_equal(lazy_record().empty(), true);
+    is_equal(lazy_recording(), false);
+}
+#endif
+
+void test_double_backward()
+{
+    // f = x^2 y + tanh(x y) + exp(x) / y
+    auto x = Value(0.5, "x");
+    auto y = Value(-1.5, "y");
+    auto f = x.square() * y + (x * y).tanh() + x.exp() / y;
+
+    std::vector<Value> g;
+    is_equal(grad(f, {x, y}, g), true);
+    auto t = std::tanh(0.5f * -1.5f);
+    auto sech2 = 1 - t * t;
+    is_close(g[0].data(), 2 * 0.5f * -1.5f + -1.5f * sech2 + std::exp(0.5f) / -1.5f);
+    is_close(g[1].data(), 0.25f + 0.5f * sech2 - std::exp(0.5f) / 2.25f);
+
+    // d2f/dx2 and d2f/dxdy
+    std::vector<Value> h;
+    is_equal(grad(g[0], {x, y}, h), true);
+    is_close(h[0].data(), 2 * -1.5f - 2 * 2.25f * t * sech2 + std::exp(0.5f) / -1.5f);
+    is_close(h[1].data(), 2 * 0.5f + sech2 - 2 * 0.5f * -1.5f * t * sech2 - std::exp(0.5f) / 2.25f);
+
+    // An exponent that needs a gradient gets a^b log(a), as from backward()
+    auto a = Value(1.5f, "a");
+    auto b = Value(2.5f, "b");
+    auto p = a.pow(b);
+    is_equal(grad(p, {a, b}, g), true);
+    is_close_eps(g[0].data(), 2.5f * std::pow(1.5f, 1.5f), 1e-5);
+    is_close_eps(g[1].data(), std::pow(1.5f, 2.5f) * std::log(1.5f), 1e-5);
+    p.backward(1, true);
+    is_close(g[0].data(), a.grad());
+    is_close(g[1].data(), b.grad());
+    std::vector<float> tangents;
+    is_equal(jvp({p}, {a, b}, {0.0f, 1.0f}, tangents), true);
+    is_close(tangents[0], b.grad());
+
+    // d2p/dbda = a^(b - 1) (1 + b log(a)) and d2p/db2 = a^b log(a)^2
+    is_equal(grad(g[1], {a, b}, h), true);
+    is_close_eps(h[0].data(), std::pow(1.5f, 1.5f) * (1 + 2.5f * std::log(1.5f)), 1e-5);
+    is_close_eps(h[1].data(), std::pow(1.5f, 2.5f) * std::log(1.5f) * std::log(1.5f), 1e-5);
+
+    // A base <= 0 gives the exponent nothing
+    auto negative = Value(-2.0f);
+    is_equal(grad(negative.pow(b), {b}, g), true);
+    is_close(g[0].data(), 0.0);
+
+    // First order through a Layer matches backward()
+    auto n = MLP(3, {4, 4, 1}, Initializer(Init::He, 11));
+    auto params = n.parameters();
+    std::vector<float> xs = {2.0f, 3.0f, -1.0f};
+    auto loss = (n(xs)[0] - 1.0f).square();
+    is_equal(grad(loss, params, g), true);
+    loss.backward(1, true);
+    for (size_t i = 0; i < params.size(); i++)
+    {
+        is_close(g[i].data(), params[i].grad());
+    }
+
+    // Hessian-vector product against a central difference of the gradient
+    std::vector<float> v(params.size());
+    for (size_t i = 0; i < v.size(); i++)
+    {
+        v[i] = std::sin(float(i));
+    }
+    std::vector<float> hv;
+    is_equal(hvp(loss, params, v, hv), true);
+
+    auto gradient_at = [&](float eps)
+    {
+        for (size_t i = 0; i < params.size(); i++)
+        {
+            params[i].data() += eps * v[i];
+        }
+        n.zero_grad();
+        (n(xs)[0] - 1.0f).square().backward();
+        std::vector<float> out;
+        for (size_t i = 0; i < params.size(); i++)
+        {
+            out.push_back(params[i].grad());
+            params[i].data() -= eps * v[i];
+        }
+        return out;
+    };
+    const float eps = 1e-2f;
+    auto plus = gradient_at(eps);
+    auto minus = gradient_at(-eps);
+    for (size_t i = 0; i < params.size(); i++)
+    {
+        is_close_eps(hv[i], (plus[i] - minus[i]) / (2 * eps), 2e-2);
+    }
+
+    // The hidden layers' W^T gz are one "layer_t" node each, not a product
+    // per weight
+    is_equal(grad(loss, params, g), true);
+    Value gv = Value::constant(0);
+    for (size_t i = 0; i < params.size(); i++)
+    {
+        gv += g[i] * v[i];
+    }
+    size_t transposes = 0;
+    std::unordered_set<Context *> seen = {gv.ctx_.get()};
+    std::vector<Context *> stack = {gv.ctx_.get()};
+    while (!stack.empty())
+    {
+        auto ctx = stack.back();
+        stack.pop_back();
+        transposes += ctx->op == "layer_t";
+        for (auto &p : ctx->prev)
+        {
+            if (seen.insert(p.get()).second)
+            {
+                stack.push_back(p.get());
+            }
+        }
+    }
+    is_equal(transposes, size_t(2));
+
+    // H v again, by reverse mode over the gradient graph, through grad() and
+    // through backward()
+    std::vector<Value> hg;
+    is_equal(grad(gv, params, hg), true);
+    n.zero_grad();
+    gv.backward(1, true);
+    for (size_t i = 0; i < params.size(); i++)
+    {
+        is_close_eps(hg[i].data(), hv[i], 1e-4);
+        is_close_eps(params[i].grad(), hv[i], 1e-4);
+    }
+}
+
+void test_backward_multi_root()
+{
+    // b is reached through paths of different lengths from the root
+    auto a = Value(2.0, "a");
+    auto b = a * a;
+    auto c = b.tanh() * b;
+    auto d = c + b;
+
+    d.backward();
+    auto expected = a.grad();
+
+    // Same graph without the final add, seeded at both of its inputs
+    a.grad() = 0;
+    auto b2 = a * a;
+    auto c2 = b2.tanh() * b2;
+    backward(std::vector<Value>{c2, b2}, {1, 1});
+    is_close(a.grad(), expected);
+
+    auto tb = std::tanh(4.0f);
+    is_close(expected, (1 + tb + 4 * (1 - tb * tb)) * 4);
+}
+
+void test_parallel_backward()
+{
+    auto n = MLP(3, {8, 8, 1});
+    auto emb = Embedding(10, 3);
+    std::vector<std::vector<size_t>> ids = {{1}, {4}, {1}, {7}};
+    std::vector<float> ys = {1.0, -1.0, -1.0, 1.0};
+
+    // Every sample shares the layers' weights, the embedding row 1 and w
+    auto w = Value(0.5, "w");
+    auto make_loss = [&]()
+    {
+        Value loss = 0;
+        for (size_t b = 0; b < ids.size(); b++)
+        {
+            auto y = n(emb(ids[b]))[0] * w;
+            loss += (y - ys[b]).square() + w * w;
+        }
+        return loss;
+    };
+
+    auto params = n.parameters();
+    auto loss = make_loss();
+    loss.backward();
+    std::vector<float> expected;
+    for (auto &p : params)
+    {
+        expected.push_back(p.grad());
+    }
+    auto expected_w = w.grad();
+    auto expected_emb = emb.parameters()[3].grad();
+
+    for (size_t threads : {2, 4})
+    {
+        n.zero_grad();
+        emb.zero_grad();
+        w.grad() = 0;
+        auto loss = make_loss();
+        loss.backward(threads);
+        for (size_t i = 0; i < params.size(); i++)
+        {
+            is_close_eps(params[i].grad(), expected[i], 1e-5);
+        }
+        is_close_eps(w.grad(), expected_w, 1e-5);
+        is_close_eps(emb.parameters()[3].grad(), expected_emb, 1e-5);
+    }
+
+    // A weight read both through its Layer node and as a Value of the scalar
+    // Neuron graph gets both contributions
+    auto &layer = n.layers[0];
+    auto shared_loss = [&]()
+    {
+        auto x = to_values(std::vector<float>{0.5f, -1.0f, 2.0f});
+        Value loss = 0;
+        for (size_t b = 0; b < 8; b++)
+        {
+            loss += layer(x)[0] + layer.neurons[0](x) * 2.0f;
+        }
+        return loss;
+    };
+    auto first = layer.neurons[0].w[0];
+    n.zero_grad();
+    shared_loss().backward();
+    auto expected_first = first.grad();
+    not_equal(expected_first, 0.0f);
+    n.zero_grad();
+    shared_loss().backward(4);
+    is_close_eps(first.grad(), expected_first, 1e-5);
+
+    // A root listed twice runs once, as it does sequentially
+    auto a = Value(3.0, "a");
+    auto b = a * a;
+    backward(std::vector<Value>{b, b}, {1, 1}, 1, true);
+    auto expected_a = a.grad();
+    a.grad() = 0;
+    backward(std::vector<Value>{b, b}, {1, 1}, 4);
+    is_close(a.grad(), expected_a);
+}
+
+void test_backward_release()
+{
+    auto n = MLP(3, {4, 4, 1}, Initializer(Init::He, 3));
+    std::vector<float> x = {2.0f, 3.0f, -1.0f};
+    auto params = n.parameters();
+    auto graph = CountingResource();
+    ScopedMemoryResources scope({&graph, nullptr});
+
+    // Retained, the graph stays and can be walked again
+    auto y = (n(x)[0] - 1.0f).square();
+    size_t nodes = graph.stats().allocations;
+    y.backward(1, true);
+    is_equal(graph.stats().allocations, nodes);
+    std::vector<float> expected;
+    for (auto &p : params)
+    {
+        expected.push_back(p.grad());
+    }
+    y.backward(1, true);
+    for (size_t i = 0; i < params.size(); i++)
+    {
+        is_close(params[i].grad(), 2 * expected[i]);
+    }
+
+    // Released, only the root is left and the gradients are the same
+    n.zero_grad();
+    y = (n(x)[0] - 1.0f).square();
+    y.backward();
+    is_equal(graph.stats().allocations, size_t(1));
+    is_equal(y.ctx_->prev.size(), size_t(0));
+    for (size_t i = 0; i < params.size(); i++)
+    {
+        is_close(params[i].grad(), expected[i]);
+    }
+
+    n.zero_grad();
+    y = (n(x)[0] - 1.0f).square();
+    y.backward(4);
+    is_equal(graph.stats().allocations, size_t(1));
+    for (size_t i = 0; i < params.size(); i++)
+    {
+        is_close_eps(params[i].grad(), expected[i], 1e-5);
+    }
+
+    // A node released by one backward() is not taken for a leaf by the next
+    auto w = Value(2.0f, "w");
+    auto h = w * 3.0f;
+    auto l1 = h.square();
+    auto l2 = h * 5.0f;
+    is_equal(l1.backward(), true);
+    is_equal(h.ctx_->released, true);
+    is_equal(w.ctx_->released, false);
+    is_equal(l2.backward(), false);
+    is_equal(l2.backward(4), false);
+    is_close(w.grad(), 36.0f);
+
+    std::vector<Value> g;
+    is_equal(grad(l2, {w}, g), false);
+    IrGraph traced;
+    is_equal(trace_ir({l2}, {}, traced), false);
+    auto inc = Incremental({l2});
+    inc.set(w, 1.0f);
+    is_equal(inc.update(), false);
+
+    // Retained, both reach w
+    w.data() = 2.0f;
+    w.grad() = 0;
+    h = w * 3.0f;
+    l1 = h.square();
+    l2 = h * 5.0f;
+    is_equal(l1.backward(1, true), true);
+    is_equal(l2.backward(), true);
+    is_close(w.grad(), 51.0f);
+}
+
+void test_incremental()
+{
+    // Scalar ops: only the cone of the changed leaf is recomputed
+    auto a = Value(0.5f);
+    auto b = Value(-1.5f);
+    auto c = Value(2.0f);
+    auto ab = (a * b).tanh();
+    auto bc = (b + c).exp();
+    auto y = ab + bc.pow(2.0f) + c.reciprocal();
+    auto inc = Incremental({y});
+
+    is_equal(inc.set(a, 0.25f), true);
+    is_equal(inc.update(), true);
+    is_equal(inc.recomputed, size_t(4));
+    is_close(y.data(), std::tanh(0.25f * -1.5f) + std::exp(1.0f) + 0.5f);
+
+    is_equal(inc.set(b, 1.0f), true);
+    is_equal(inc.update(), true);
+    is_close_eps(y.data(), std::tanh(0.25f) + std::exp(6.0f) + 0.5f, 1e-3);
+
+    // Nothing touched, nothing recomputed
+    is_equal(inc.update(), true);
+    is_equal(inc.recomputed, size_t(0));
+    is_equal(inc.touch(Value(1.0f)), false);
+
+    // A saturated tanh stops the propagation
+    auto s = Value(20.0f);
+    auto t = s.tanh() * 2.0f + 1.0f;
+    auto sat = Incremental({t});
+    sat.set(s, 30.0f);
+    sat.update();
+    is_equal(sat.recomputed, size_t(1));
+
+    // An MLP over several samples, against building it again
+    auto n = MLP(3, {8, 8, 1}, Initializer(Init::He, 5));
+    std::vector<std::vector<Value>> xs;
+    std::vector<Value> ys;
+    for (size_t k = 0; k < 4; k++)
+    {
+        xs.push_back({Value(0.1f * k), Value(-0.5f), Value(1.0f - 0.2f * k)});
+        ys.push_back(n(xs.back())[0]);
+    }
+    Value loss = 0;
+    for (auto &v : ys)
+    {
+        loss += v.square();
+    }
+    auto net = Incremental({loss});
+    size_t total = net.order.size();
+
+    auto check = [&]()
+    {
+        float expected = 0;
+        for (size_t k = 0; k < xs.size(); k++)
+        {
+            std::vector<float> x;
+            for (auto &v : xs[k])
+            {
+                x.push_back(v.data());
+            }
+            float yk = n(x)[0].data();
+            is_close(ys[k].data(), yk);
+            expected += yk * yk;
+        }
+        is_close(loss.data(), expected);
+    };
+
+    // An input of one sample touches that sample's layers and the sum
+    net.set(xs[2][1], 0.75f);
+    is_equal(net.update(), true);
+    check();
+    is_equal(net.recomputed > 0 && net.recomputed < total / 2, true);
+
+    // A weight of the first layer touches one row of it in every sample
+    auto params = n.parameters();
+    net.set(params[1], params[1].data() + 0.5f);
+    is_equal(net.update(), true);
+    check();
+    is_equal(net.recomputed < total, true);
+
+    // The gradients of the updated graph are those of a fresh one
+    n.zero_grad();
+    loss.backward(1, true);
+    std::vector<float> grads;
+    for (auto &p : params)
+    {
+        grads.push_back(p.grad());
+    }
+    n.zero_grad();
+    Value fresh = 0;
+    for (auto &x : xs)
+    {
+        fresh += n(x)[0].square();
+    }
+    fresh.backward();
+    for (size_t i = 0; i < params.size(); i++)
+    {
+        is_close(params[i].grad(), grads[i]);
+    }
+}
+
+void test_memory_resources()
+{
+    auto huge = HugePageResource(HugePages::Transparent);
+    void *p = huge.allocate(3 << 20, 64);
+    is_equal(reinterpret_cast<uintptr_t>(p) % huge_page_size, uintptr_t(0));
+    static_cast<char *>(p)[(3 << 20) - 1] = 1;
+    auto stats = huge.stats();
+    is_equal(stats.bytes, size_t(4 << 20));
+    is_equal(stats.pages_2m(), size_t(2));
+    huge.deallocate(p, 3 << 20, 64);
+    is_equal(huge.stats().bytes, size_t(0));
+    is_equal(huge.stats().peak_bytes, size_t(4 << 20));
+
+    // Without a reserved pool an explicit mapping falls back, but still works
+    auto hugetlb = HugePageResource(HugePages::Explicit);
+    p = hugetlb.allocate(1000, 64);
+    static_cast<char *>(p)[999] = 1;
+    is_equal(hugetlb.stats().allocations, size_t(1));
+    hugetlb.deallocate(p, 1000, 64);
+
+    // Graph nodes and weights from their own resources
+    auto pool = std::pmr::synchronized_pool_resource(&huge);
+    auto graph = CountingResource(&pool);
+    auto weights = CountingResource(&huge);
+    std::vector<float> x = {2.0f, 3.0f, -1.0f};
+    auto expected = MLP(3, {4, 4, 1}, Initializer(Init::He, 7));
+    auto y = expected(x)[0];
+    y.backward();
+    {
+        ScopedMemoryResources scope({&graph, &weights});
+        auto n = MLP(3, {4, 4, 1}, Initializer(Init::He, 7));
+        is_equal(weights.stats().allocations > 0, true);
+
+        auto out = n(x)[0];
+        is_equal(graph.stats().allocations > 0, true);
+        out.backward();
+        is_close(out.data(), y.data());
+        auto params = n.parameters();
+        auto expected_params = expected.parameters();
+        for (size_t i = 0; i < params.size(); i++)
+        {
+            is_close(params[i].grad(), expected_params[i].grad());
+        }
+    }
+    is_equal(graph.stats().bytes, size_t(0));
+    is_equal(weights.stats().bytes, size_t(0));
+    is_equal(memory_resources().graph, static_cast<std::pmr::memory_resource *>(nullptr));
+}
+
+void test_pipeline()
+{
+    std::vector<std::vector<float>> xs = {
+        {2.0f, 3.0f, -1.0f},
+        {3.0, -1.0, 0.5},
+        {0.5, 1.0, 1.0},
+        {1.0, 1.0, -1.0},
+        {-1.0, 0.5, 2.0},
+    };
+    std::vector<float> ys = {1.0, -1.0, -1.0, 1.0, -1.0};
+    const float lr = 0.05;
+
+    auto a = MLP(3, {4, 4, 4, 1});
+    auto b = MLP(3, {4, 4, 4, 1});
+    auto pa = a.parameters();
+    auto pb = b.parameters();
+    for (size_t i = 0; i < pa.size(); i++)
+    {
+        pb[i].data() = pa[i].data();
+    }
+
+    auto pipe = PipelineTrainer(b, 3, 2);
+    is_equal(pipe.stages.size(), size_t(3));
+
+    for (size_t step = 0; step < 3; step++)
+    {
+        auto loss = Value::constant(0.0);
+        for (size_t i = 0; i < xs.size(); i++)
+        {
+            auto yout = a(xs[i]);
+            Value sub = yout[0] - ys[i];
+            loss += sub * sub;
+        }
+        a.zero_grad();
+        loss.backward();
+        for (auto &p : pa)
+        {
+            p.data() += -(p.grad() * lr);
+        }
+
+        float pipe_loss = pipe.step(xs, ys, lr);
+        is_close_eps(pipe_loss, loss.data(), 1e-5);
+    }
+
+    for (size_t i = 0; i < pa.size(); i++)
+    {
+        is_close_eps(pb[i].data(), pa[i].data(), 1e-5);
+    }
+}
+
+void test_allreduce()
+{
+    const size_t world_size = 3;
+    const size_t n = 10;
+    auto group = SharedMemoryGroup(world_size, n);
+
+    auto rc = launch(group, [&](SharedMemoryGroup &g)
+                     {
+        std::vector<float> values(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            values[i] = g.rank * 100 + i;
+        }
+        if (!g.allreduce_mean(values))
+        {
+            return 1;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            // Mean of 0, 100, 200 plus i
+            is_close(values[i], 100 + i);
+        }
+
+        std::vector<float> b(n, g.rank);
+        if (!g.broadcast(b, 1))
+        {
+            return 1;
+        }
+        is_close(b[n - 1], 1.0);
+        return 0; });
+
+    is_equal(rc, 0);
+
+    // A rank failing must not leave the others stuck in a barrier
+    auto failing = SharedMemoryGroup(world_size, n);
+    rc = launch(failing, [&](SharedMemoryGroup &g)
+                {
+        if (g.rank == 0)
+        {
+            return 1;
+        }
+        std::vector<float> values(n);
+        return g.allreduce_sum(values) ? 0 : 2; });
+    not_equal(rc, 0);
+
+    // Children of the host that are not ranks are left for the host to reap,
+    // even one that exits while the ranks run
+    pid_t other = fork();
+    if (other == 0)
+    {
+        _exit(7);
+    }
+    auto quiet = SharedMemoryGroup(world_size, n);
+    rc = launch(quiet, [&](SharedMemoryGroup &g)
+                {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        return 0; });
+    is_equal(rc, 0);
+    int status = 0;
+    is_equal(waitpid(other, &status, 0), other);
+    is_equal(WEXITSTATUS(status), 7);
+
+    // Ranks run a parallel backward() on a pool of their own, not on the
+    // threadless copy of the one the host already started
+    auto wide_backward = []()
+    {
+        std::vector<Value> xs;
+        Value sum = Value(0.0f);
+        for (int j = 0; j < 64; j++)
+        {
+            xs.push_back(Value(float(j)));
+            sum = sum + xs.back() * xs.back();
+        }
+        sum.backward(4);
+        return xs[10].grad() == 20.0f;
+    };
+    is_equal(wide_backward(), true);
+    auto pooled = SharedMemoryGroup(world_size, n);
+    rc = launch(pooled, [&](SharedMemoryGroup &g)
+                { return wide_backward() ? 0 : 1; });
+    is_equal(rc, 0);
+}
+
+void test_data_parallel()
+{
+    std::vector<std::vector<float>> xs = {
+        {2.0f, 3.0f, -1.0f},
+        {3.0, -1.0, 0.5},
+        {0.5, 1.0, 1.0},
+        {1.0, 1.0, -1.0},
+        {-1.0, 0.5, 2.0},
+        {0.0, -2.0, 1.0},
+    };
+    std::vector<float> ys = {1.0, -1.0, -1.0, 1.0, -1.0, 1.0};
+    const size_t world_size = 2;
+
+    auto n = MLP(3, {4, 4, 1});
+    auto group = SharedMemoryGroup(world_size, n.parameters().size());
+
+    auto rc = launch(group, [&](SharedMemoryGroup &g)
+                     {
+        // Reseed every replica differently, then start from rank 0's weights
+        auto params = n.parameters();
+        for (auto &p : params)
+        {
+            p.data() += g.rank;
+        }
+        if (!broadcast_parameters(g, params))
+        {
+            return 1;
+        }
+
+        // Single-process reference on a copy of the starting weights
+        auto ref = MLP(3, {4, 4, 1});
+        auto ref_params = ref.parameters();
+        for (size_t i = 0; i < params.size(); i++)
+        {
+            ref_params[i].data() = params[i].data();
+        }
+        auto ref_loss = Value::constant(0.0);
+        for (size_t i = 0; i < xs.size(); i++)
+        {
+            Value sub = ref(xs[i])[0] - ys[i];
+            ref_loss += sub * sub;
+        }
+        ref_loss.backward();
+
+        // Each rank takes every world_size-th sample
+        auto loss = Value::constant(0.0);
+        for (size_t i = g.rank; i < xs.size(); i += g.world_size)
+        {
+            Value sub = n(xs[i])[0] - ys[i];
+            loss += sub * sub;
+        }
+        n.zero_grad();
+        loss.backward();
+        if (!allreduce_gradients(g, params))
+        {
+            return 1;
+        }
+
+        // Averaged gradients are the full-batch gradient over world_size
+        for (size_t i = 0; i < params.size(); i++)
+        {
+            is_close_eps(params[i].grad() * g.world_size, ref_params[i].grad(), 1e-5);
+        }
+        return 0; });
+
+    is_equal(rc, 0);
+}
+
+void test_predict()
+{
+    auto n = MLP(3, {4, 4, 2});
+    std::vector<std::vector<float>> xs = {
+        {2.0f, 3.0f, -1.0f},
+        {3.0, -1.0, 0.5},
+        {0.5, 1.0, 1.0},
+    };
+
+    auto ys = n.predict(xs);
+    is_equal(ys.size(), xs.size());
+    for (size_t i = 0; i < xs.size(); i++)
+    {
+        auto expected = n(xs[i]);
+        is_equal(ys[i].size(), expected.size());
+        for (size_t j = 0; j < expected.size(); j++)
+        {
+            is_close(ys[i][j], expected[j].data());
+        }
+    }
+}
+
+void test_per_sample_gradients()
+{
+    auto n = MLP(3, {4, 4, 1});
+    std::vector<std::vector<float>> xs = {
+        {2.0f, 3.0f, -1.0f},
+        {3.0, -1.0, 0.5},
+        {0.5, 1.0, 1.0},
+    };
+    std::vector<float> ys = {1.0, -1.0, -1.0};
+
+    // Squared error, whose derivative at the output is 2 (y - target)
+    auto preds = n.predict(xs);
+    std::vector<float> dys(xs.size());
+    for (size_t b = 0; b < xs.size(); b++)
+    {
+        dys[b] = 2 * (preds[b][0] - ys[b]);
+    }
+
+    auto grads = n.per_sample_gradients(xs, dys);
+    auto params = n.parameters();
+    is_equal(grads.size(), xs.size());
+
+    for (size_t b = 0; b < xs.size(); b++)
+    {
+        is_equal(grads[b].size(), params.size());
+
+        Value sub = n(xs[b])[0] - ys[b];
+        auto loss = sub * sub;
+        n.zero_grad();
+        loss.backward();
+
+        for (size_t i = 0; i < params.size(); i++)
+        {
+            is_close_eps(grads[b][i], params[i].grad(), 1e-5);
+        }
+    }
+}
+
+void test_inference_server()
+{
+    auto n = MLP(3, {4, 4, 1});
+    auto path = "/tmp/micrograd-test-" + std::to_string(getpid()) + ".sock";
+    auto server = InferenceServer(n, path, 4, 1000);
+    is_equal(server.start(), true);
+
+    std::vector<std::vector<float>> xs = {
+        {2.0f, 3.0f, -1.0f},
+        {3.0, -1.0, 0.5},
+        {0.5, 1.0, 1.0},
+        {1.0, 1.0, -1.0},
+        {-1.0, 0.5, 2.0},
+    };
+
+    // All requests in flight at once, replies matched up by id
+    InferenceClient client(path);
+    is_equal(client.ok(), true);
+    for (size_t i = 0; i < xs.size(); i++)
+    {
+        is_equal(client.send(i, xs[i]), true);
+    }
+    for (size_t i = 0; i < xs.size(); i++)
+    {
+        uint32_t id;
+        std::vector<float> y;
+        is_equal(client.receive(id, y), true);
+        is_equal(y.size(), size_t(1));
+        is_close(y[0], n(xs[id])[0].data());
+    }
+
+    // Wrong input size
+    std::vector<float> y;
+    is_equal(client.predict({1.0f}, y), false);
+
+    ServerStats stats;
+    is_equal(client.stats(stats), true);
+    is_equal(stats.requests, uint64_t(xs.size()));
+    is_equal(stats.batches >= 2, true);
+
+    // Replies are limited to what the header's count can describe
+    std::vector<float> big(size_t(std::numeric_limits<uint16_t>::max()) + 1);
+    is_equal(write_message(client.fd, 0, static_cast<uint16_t>(MessageType::Predict), big.data(), big.size()), false);
+
+    // The reader of a closed connection is joined on the next accept
+    {
+        InferenceClient other(path);
+        is_equal(other.predict(xs[0], y), true);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    InferenceClient last(path);
+    is_equal(last.predict(xs[0], y), true);
+    {
+        std::lock_guard<std::mutex> lock(server.connections_mutex);
+        is_equal(server.readers.size(), size_t(2));
+    }
+
+    server.stop();
+
+    // A client that doesn't read its replies only holds up its own. Replies of
+    // 16KB fill its socket buffer after a few requests.
+    auto wide = MLP(3, {4096}, Initializer(Init::He, 1));
+    auto wide_path = path + ".wide";
+    auto wide_server = InferenceServer(wide, wide_path, 4, 100);
+    is_equal(wide_server.start(), true);
+    InferenceClient slow(wide_path);
+    for (size_t i = 0; i < 64; i++)
+    {
+        is_equal(slow.send(i, xs[0]), true);
+    }
+    InferenceClient fast(wide_path);
+    timeval timeout{5, 0};
+    setsockopt(fast.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    for (size_t i = 0; i < 4; i++)
+    {
+        is_equal(fast.predict(xs[1], y), true);
+        is_equal(y.size(), size_t(4096));
+    }
+    wide_server.stop();
+}
+
+void test_freeze()
+{
+    auto n = MLP(3, {4, 4, 1});
+    for (size_t i = 0; i + 1 < n.layers.size(); i++)
+    {
+        n.layers[i].freeze();
+    }
+
+    is_equal(n.parameters().size(), size_t(41));
+    is_equal(n.trainable_parameters().size(), n.layers.back().parameters().size());
+
+    // Frozen layers on constant inputs fold away, so only the last layer has a graph
+    std::vector<float> x = {2.0f, 3.0f, -1.0f};
+    auto xv = to_values(x);
+    auto h0 = n.layers[0](xv);
+    auto h = n.layers[1](h0);
+    is_equal(h[0].requires_grad(), false);
+
+    auto y = n(x);
+    is_equal(y[0].requires_grad(), true);
+    n.zero_grad();
+    y[0].backward();
+
+    for (auto &p : n.layers[0].parameters())
+    {
+        is_close(p.grad(), 0.0);
+    }
+    float total = 0;
+    for (auto &p : n.trainable_parameters())
+    {
+        total += std::abs(p.grad());
+    }
+    not_equal(total, 0.0f);
+
+    n.freeze(false);
+    is_equal(n.trainable_parameters().size(), size_t(41));
+
+    // Freezing after a backward doesn't leave stale gradients behind
+    n(x)[0].backward();
+    n.freeze();
+    n.zero_grad();
+    for (auto &p : n.parameters())
+    {
+        is_close(p.grad(), 0.0);
+    }
+}
+
+void test_philox()
+{
+    // Known-answer vectors from the Random123 distribution
+    auto zero = philox4x32({0, 0, 0, 0}, {0, 0});
+    is_equal(zero[0], 0x6627e8d5u);
+    is_equal(zero[1], 0xe169c58du);
+    is_equal(zero[2], 0xbc57ac4cu);
+    is_equal(zero[3], 0x9b00dbd8u);
+
+    auto ones = philox4x32({0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff}, {0xffffffff, 0xffffffff});
+    is_equal(ones[0], 0x408f276du);
+    is_equal(ones[1], 0x41c83b0eu);
+    is_equal(ones[2], 0xa20bc7c6u);
+    is_equal(ones[3], 0x6d5451fdu);
+}
+
+void test_init()
+{
+    auto a = MLP(8, {16, 16, 1}, Initializer(Init::Uniform, 42), 1);
+    auto b = MLP(8, {16, 16, 1}, Initializer(Init::Uniform, 42), 4);
+    auto c = MLP(8, {16, 16, 1}, Initializer(Init::Uniform, 43), 4);
+
+    auto pa = a.parameters();
+    auto pb = b.parameters();
+    auto pc = c.parameters();
+    size_t same_as_c = 0;
+    for (size_t i = 0; i < pa.size(); i++)
+    {
+        is_equal(pa[i].data(), pb[i].data());
+        same_as_c += pa[i].data() == pc[i].data();
+    }
+    is_equal(same_as_c < pa.size() / 10, true);
+
+    auto x = MLP(8, {16, 4}, Initializer(Init::Xavier, 1));
+    float bound = std::sqrt(6.0f / (16 + 4));
+    for (auto &n : x.layers[1].neurons)
+    {
+        for (auto &w : n.w)
+        {
+            is_equal(std::abs(w.data()) <= bound, true);
+        }
+        is_close(n.b.data(), 0.0);
+    }
+
+    // Default Initializers take consecutive seeds from a fixed start, so two
+    // default neurons differ but every run builds the same ones
+    auto first = Initializer();
+    auto second = Initializer();
+    is_equal(second.seed, first.seed + 1);
+    auto n1 = Neuron(4);
+    auto n2 = Neuron(4);
+    not_equal(n1.w[0].data(), n2.w[0].data());
+    is_equal(n1.w[0].data(), Initializer(Init::Uniform, second.seed + 1).weight(0, 4, 1));
+}
+
 int main()
 {
     test_instantiate();
@@ -374,14 +1940,40 @@ int main()
     test_tanh();
     test_exp();
     test_pow();
+    test_approx();
+    test_native_ops();
+    test_fused();
+    test_value_ownership();
     test_to_values<float>();
     test_to_values<double>();
     test_to_values<int>();
     test_to_values<size_t>();
     test_dot();
     test_expr();
+    test_requires_grad();
+#ifdef MICROGRAD_LAZY
+    test_lazy();
+#endif
+    test_backward_multi_root();
+    test_double_backward();
+    test_parallel_backward();
+    test_backward_release();
+    test_incremental();
+    test_memory_resources();
     test_neuron();
     test_layer();
+    test_layer_backward();
+    test_embedding();
     test_mlp();
+    test_ir();
+    test_philox();
+    test_init();
+    test_freeze();
+    test_pipeline();
+    test_allreduce();
+    test_data_parallel();
+    test_predict();
+    test_per_sample_gradients();
+    test_inference_server();
     return 0;
 }
\ No newline at end of file